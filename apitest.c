@@ -0,0 +1,236 @@
+/**
+ * @file apitest.c
+ *
+ * apitest compares mm_memalign, mm_realloc and mm_calloc against what a
+ * program would have to do with only mm_malloc and mm_free:
+ *
+ *  - memalign allocates objects of random sizes up to maxsize with the
+ *    given alignment, first with mm_memalign and then by allocating
+ *    alignment - 1 extra bytes and rounding up, and reports how much
+ *    memory each took from mem_sbrk as well as the time
+ *  - realloc grows buffers a bit at a time, first with mm_realloc and
+ *    then by allocating a bigger buffer, copying and freeing the old one,
+ *    once for buffers up to maxsize and once for one buffer up to bigsize
+ *  - calloc allocates objects of random sizes up to bigsize until
+ *    CALLOC_BYTES or nobjects are in use, with mm_calloc and with
+ *    mm_malloc and memset, first out of fresh memory and then out of
+ *    memory that was used and freed
+ *
+ * Each of them runs in a process of its own, so none of them gets memory
+ * the one before it freed.
+ *
+ * Try the following:
+ *
+ *  apitest 100000 4096 64
+ *  apitest 100000 1000 4096 67108864
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "timer.h"
+#include "memlib.h"
+#include "malloc.h"
+
+int nobjects = 100000;	// Default number of objects.
+int maxsize = 4096;	// Default biggest object size.
+int alignment = 64;	// Default alignment.
+int bigsize = 16777216;	// Default size the big buffer grows to.
+
+unsigned int seed = 12345;
+
+#define REALLOC_BUFFERS 1000
+#define REALLOC_STEP 16
+#define BIG_STEP 65536
+#define CALLOC_BYTES (128L << 20)
+
+
+// grow a buffer from step to size bytes, step bytes at a time
+char *grow (char *buf, int size, int step, int naive)
+{
+  int len;
+  for (len = step; len <= size; len += step) {
+    if (naive) {
+      char *bigger = (char *)mm_malloc(len);
+      if (buf != NULL) {
+	memcpy(bigger, buf, len - step);
+	mm_free(buf);
+      }
+      buf = bigger;
+    } else {
+      buf = (char *)mm_realloc(buf, len);
+    }
+    buf[len - 1] = 1;
+  }
+  return buf;
+}
+
+void bench_realloc ()
+{
+  char **bufs = (char **)malloc(REALLOC_BUFFERS * sizeof(char *));
+  int naive, i;
+
+  for (naive = 0; naive < 2; naive++) {
+    timer_start();
+    for (i = 0; i < REALLOC_BUFFERS; i++) {
+      bufs[i] = grow(NULL, maxsize, REALLOC_STEP, naive);
+    }
+    for (i = 0; i < REALLOC_BUFFERS; i++) {
+      mm_free(bufs[i]);
+    }
+    double small = timer_stop();
+
+    timer_start();
+    mm_free(grow(NULL, bigsize, BIG_STEP, naive));
+    double big = timer_stop();
+
+    printf ("%-28s %12f %12f\n", naive ? "malloc, copy and free" : "mm_realloc", small, big);
+  }
+  free(bufs);
+}
+
+// allocate objects of random sizes up to bigsize into objs, cleared,
+// until CALLOC_BYTES are in use, and return how many there are
+int fill_calloc (char **objs, int naive)
+{
+  unsigned int s = seed;
+  long bytes = 0;
+  int n;
+  for (n = 0; n < nobjects && bytes < CALLOC_BYTES; n++) {
+    int size = 1 + rand_r(&s) % bigsize;
+    if (naive) {
+      objs[n] = (char *)mm_malloc(size);
+      memset(objs[n], 0, size);
+    } else {
+      objs[n] = (char *)mm_calloc(1, size);
+    }
+    objs[n][size - 1] = 1;
+    bytes += size;
+  }
+  return n;
+}
+
+void free_all (char **objs, int n)
+{
+  int i;
+  for (i = 0; i < n; i++) {
+    mm_free(objs[i]);
+  }
+}
+
+void bench_calloc ()
+{
+  char **objs[2];
+  int n[2];
+  double fresh[2], reused[2];
+  int naive;
+
+  // both get fresh memory the first time, since the other's is still in use
+  for (naive = 0; naive < 2; naive++) {
+    objs[naive] = (char **)malloc(nobjects * sizeof(char *));
+    timer_start();
+    n[naive] = fill_calloc(objs[naive], naive);
+    fresh[naive] = timer_stop();
+  }
+  free_all(objs[0], n[0]);
+  free_all(objs[1], n[1]);
+  // and then memory that has been used and freed
+  for (naive = 0; naive < 2; naive++) {
+    timer_start();
+    n[naive] = fill_calloc(objs[naive], naive);
+    reused[naive] = timer_stop();
+    free_all(objs[naive], n[naive]);
+    free(objs[naive]);
+  }
+  printf ("%-28s %12f %12f\n", "mm_calloc", fresh[0], reused[0]);
+  printf ("%-28s %12f %12f\n", "mm_malloc and memset", fresh[1], reused[1]);
+}
+
+void bench_memalign ()
+{
+  char **objs[2];
+  int naive, i;
+
+  // the objects of both stay in use until the end, so both get fresh memory
+  for (naive = 0; naive < 2; naive++) {
+    unsigned int s = seed;
+    long before = mem_usage();
+    objs[naive] = (char **)malloc(nobjects * sizeof(char *));
+    timer_start();
+    for (i = 0; i < nobjects; i++) {
+      int size = 1 + rand_r(&s) % maxsize;
+      char *p;
+      if (naive) {
+	objs[naive][i] = (char *)mm_malloc(size + alignment - 1);
+	p = (char *)(((size_t)objs[naive][i] + alignment - 1) / alignment * alignment);
+      } else {
+	objs[naive][i] = p = (char *)mm_memalign(alignment, size);
+      }
+      p[0] = 1;
+    }
+    double t = timer_stop();
+    printf ("%-28s %12f %14ld\n", naive ? "mm_malloc and round up" : "mm_memalign", t, mem_usage() - before);
+  }
+  for (naive = 0; naive < 2; naive++) {
+    free_all(objs[naive], nobjects);
+    free(objs[naive]);
+  }
+}
+// run one of the benchmarks with a freshly initialized allocator
+void run (void (*bench)())
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    /* Call allocator-specific initialization function */
+    mm_init();
+    bench();
+    fflush(stdout);
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+}
+
+
+int main (int argc, char * argv[])
+{
+  if (argc >= 2) {
+    nobjects = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    maxsize = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    alignment = atoi(argv[3]);
+  }
+
+  if (argc >= 5) {
+    bigsize = atoi(argv[4]);
+  }
+
+  if (nobjects < 1 || maxsize < REALLOC_STEP || bigsize < BIG_STEP ||
+      alignment < 1 || (alignment & (alignment - 1)) != 0) {
+    fprintf (stderr, "Usage: %s nobjects maxsize alignment [bigsize]\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Running apitest for %d objects up to %d bytes, alignment %d, big buffers of %d bytes...\n",
+	  nobjects, maxsize, alignment, bigsize);
+
+  printf ("%-28s %12s %14s\n", "memalign", "seconds", "memory used");
+  run(bench_memalign);
+
+  printf ("%-28s %12s %12s\n", "realloc", "seconds", "big seconds");
+  run(bench_realloc);
+
+  printf ("%-28s %12s %12s\n", "calloc", "fresh", "reused");
+  run(bench_calloc);
+
+  return 0;
+}
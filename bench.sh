@@ -0,0 +1,163 @@
+#!/bin/sh
+#
+# bench.sh - runs the benchmarks over a sweep of thread counts, a few
+# times each, on this allocator and on the C library's, and reports
+# throughput, speedup over one thread and memory use as CSV (and JSON).
+#
+#  usage: bench.sh [-t "threads ..."] [-r repetitions] [-a "allocators"]
+#                  [-o prefix] [workload ...]
+#
+#  -t  thread counts, powers of two up to twice the processors by default
+#  -r  runs of every point, 3 by default; the median is reported
+#  -a  camel (the release builds, e.g. ./threadtest) and/or libc (the
+#      same benchmarks on the C library's malloc, e.g. ./threadtest-libc)
+#  -o  write prefix.csv and prefix.json instead of CSV to stdout
+#
+# The workloads are threadtest, larson, cache-thrash and cache-scratch,
+# all of them by default. make bench builds everything and runs this
+# into bench/. Every workload does the same total work at any thread
+# count, except larson, which runs for a fixed time, so throughput is:
+#  threadtest                   objects allocated per second
+#  larson                       objects allocated per second, as it says
+#  cache-thrash, cache-scratch  passes over an object per second
+# speedup is the median throughput over that at one thread (the lowest
+# thread count swept), and vs_libc is it over the C library's at the
+# same thread count. mem_used is mem_usage at the end of the median run
+# and frag is mem_used over the bytes the workload keeps live at its
+# peak, for threadtest and larson (the others keep a few objects only).
+# memlib never gives memory back, so that's our peak, but the C library
+# does, so for libc it's what was left and frag is a lower bound.
+#
+# The parameters of each workload can be changed in the environment:
+THREADTEST_ARGS=${THREADTEST_ARGS:-"50 30000 0 8"}	# iterations objects work size
+LARSON_ARGS=${LARSON_ARGS:-"2 8 40 10000 10 1"}	# seconds min max chunks/thread rounds seed
+CACHE_ARGS=${CACHE_ARGS:-"1000 8 100000"}	# iterations objSize repetitions
+
+threads=""
+reps=3
+allocators="camel libc"
+prefix=""
+while getopts t:r:a:o: opt; do
+	case $opt in
+	t) threads=$OPTARG ;;
+	r) reps=$OPTARG ;;
+	a) allocators=$OPTARG ;;
+	o) prefix=$OPTARG ;;
+	*) sed -n 's/^# \{0,1\}//; 3,14p' "$0" >&2; exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+workloads=${*:-"threadtest larson cache-thrash cache-scratch"}
+
+if [ -z "$threads" ]; then
+	n=1
+	max=$((2 * $(nproc)))
+	while [ $n -le $max ]; do
+		threads="$threads $n"
+		n=$((n * 2))
+	done
+fi
+
+# one run of a workload, printing "seconds throughput mem_used frag"
+run() {
+	rbin=$1; rt=$2
+	case $rbin in
+	threadtest*)
+		set -- $THREADTEST_ARGS
+		./$rbin $rt "$@" | awk -v ops=$(($1 * $2)) -v live=$(($2 * $4 * 8)) '
+			/^Time elapsed/ { s = $4 } /^Memory used/ { m = $4 }
+			END { if (s > 0) print s, ops / s, m, m / live }' ;;
+	larson*)
+		./$rbin $LARSON_ARGS $rt | awk '
+			/^Throughput/ { r = $3 } /^Memory used/ { m = $4; f = $9 }
+			END { if (r > 0) print "-", r, m, f }' ;;
+	cache-*)
+		set -- $CACHE_ARGS
+		./$rbin $rt "$@" | awk -v ops=$(($1 * $3)) '
+			/^Time elapsed/ { s = $4 } /^Memory used/ { m = $4 }
+			END { if (s > 0) print s, ops / s, m, "-" }' ;;
+	esac
+}
+
+raw=$(mktemp)
+trap 'rm -f "$raw"' EXIT
+for w in $workloads; do
+	for a in $allocators; do
+		bin=$w
+		[ $a = libc ] && bin=$w-libc
+		if [ ! -x ./$bin ]; then
+			echo "bench.sh: no ./$bin, try make bench" >&2
+			exit 1
+		fi
+		for t in $threads; do
+			i=0
+			while [ $i -lt $reps ]; do
+				echo "$w $a $t: run $((i + 1)) of $reps" >&2
+				out=$(run $bin $t)
+				if [ -z "$out" ]; then
+					echo "bench.sh: $bin with $t threads failed" >&2
+					exit 1
+				fi
+				echo "$w $a $t $out" >> "$raw"
+				i=$((i + 1))
+			done
+		done
+	done
+done
+
+# the median run of every point by throughput, then speedup and vs_libc
+# from the medians, by workload, allocator and thread count
+report=$(sort -k1,1 -k2,2 -k3,3n -k5,5g "$raw" | awk '
+	function flush() {
+		if (n == 0) return
+		m = int((n + 1) / 2)
+		key[++k] = w " " a " " t
+		row[k] = w "," a "," t "," n "," med_s[m] "," sprintf("%.0f", tp[m]) "," \
+		         sprintf("%.0f", tp[1]) "," sprintf("%.0f", tp[n]) "," med_m[m] "," med_f[m]
+		put[w " " a " " t] = tp[m]
+		n = 0
+	}
+	{
+		if ($1 " " $2 " " $3 != w " " a " " t) flush()
+		w = $1; a = $2; t = $3
+		++n; med_s[n] = $4; tp[n] = $5; med_m[n] = $6; med_f[n] = $7
+	}
+	END {
+		flush()
+		for (i = 1; i <= k; i++) {
+			split(key[i], f, " ")
+			base = ""
+			for (j = 1; j <= k; j++) {
+				split(key[j], g, " ")
+				if (g[1] == f[1] && g[2] == f[2] && (base == "" || g[3] + 0 < lo)) {
+					base = put[key[j]]; lo = g[3] + 0
+				}
+			}
+			libc = put[f[1] " libc " f[3]]
+			printf "%s,%.2f,%s\n", row[i], put[key[i]] / base, \
+			       (libc > 0 ? sprintf("%.2f", put[key[i]] / libc) : "-")
+		}
+	}')
+
+header="workload,allocator,threads,runs,seconds,throughput,throughput_min,throughput_max,mem_used,frag,speedup,vs_libc"
+csv=$(printf '%s\n%s\n' "$header" "$report")
+
+if [ -z "$prefix" ]; then
+	echo "$csv"
+	exit 0
+fi
+echo "$csv" > "$prefix.csv"
+echo "$csv" | awk -F, '
+	NR == 1 { for (i = 1; i <= NF; i++) name[i] = $i; next }
+	{
+		printf "%s  {", (NR > 2 ? ",\n" : "[\n")
+		for (i = 1; i <= NF; i++) {
+			v = $i
+			if (v == "-") v = "null"
+			else if (i <= 2) v = "\"" v "\""
+			printf "%s\"%s\": %s", (i > 1 ? ", " : ""), name[i], v
+		}
+		printf "}"
+	}
+	END { print (NR > 1 ? "\n]" : "[]") }' > "$prefix.json"
+echo "bench.sh: wrote $prefix.csv and $prefix.json" >&2
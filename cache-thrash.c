@@ -39,6 +39,7 @@
 #include "mm_thread.h"
 #include "timer.h"
 #include "malloc.h"
+#include "memlib.h"
 
 // This struct just holds arguments to each thread.
 struct workerArg {
@@ -125,9 +126,9 @@ int main (int argc, char * argv[])
     pthread_join(threads[i], NULL);
   }
 
-  double t = timer_stop();
+  u_int64_t ns = timer_stop_ns();
 
-  printf ("Time elapsed = %f seconds\n", t);
-  printf ("Memory used = %d bytes\n",mem_usage());
+  printf ("Time elapsed = %f seconds (%llu ns)\n", ns / 1e9, (unsigned long long)ns);
+  printf ("Memory used = %ld bytes\n",mem_usage());
   return 0;
 }
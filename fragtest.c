@@ -0,0 +1,128 @@
+/**
+ * @file fragtest.c
+ *
+ * fragtest measures how much memory the size classes waste.
+ * It allocates a number of objects with sizes drawn uniformly from
+ * [minsize, maxsize] and then reports, for every size class used,
+ * the bytes requested against the bytes consumed by the blocks they
+ * were given, along with the worst case internal fragmentation of
+ * that class.  Objects too big for any size class are totalled on a
+ * line of their own against the pages they were given.  The last lines compare the total requested against
+ * what was taken from mem_sbrk, which also counts superblock headers
+ * and partially used superblocks.
+ *
+ * Try the following:
+ *
+ *  fragtest 10 500 100000
+ *  fragtest 1 4000 100000
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memlib.h"
+#include "malloc.h"
+
+// allocator internals, so we can tell which class each request landed in
+extern int find_size_class(size_t s);
+extern size_t *SIZE_CLASSES;
+extern int NUM_SIZE_CLASSES;
+extern size_t large_span_size(size_t size);
+
+int minsize = 10;	// Default smallest object size.
+int maxsize = 500;	// Default biggest object size.
+int nobjects = 100000;	// Default number of objects.
+unsigned int seed = 12345;	// Default random seed.
+
+
+int main (int argc, char * argv[])
+{
+  if (argc >= 2) {
+    minsize = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    maxsize = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    nobjects = atoi(argv[3]);
+  }
+
+  if (argc >= 5) {
+    seed = atoi(argv[4]);
+  }
+
+  if (minsize < 1 || maxsize < minsize || nobjects < 1) {
+    fprintf (stderr, "Usage: %s minsize maxsize nobjects [seed]\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Running fragtest for sizes %d to %d, %d objects...\n", minsize, maxsize, nobjects);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+  long base_usage = mem_usage();
+
+  // per size class bookkeeping, kept out of the allocator being measured
+  long *count = (long *)calloc(NUM_SIZE_CLASSES, sizeof(long));
+  long *requested = (long *)calloc(NUM_SIZE_CLASSES, sizeof(long));
+  char **objs = (char **)calloc(nobjects, sizeof(char *));
+
+  long large_count = 0;
+  long large_requested = 0;
+  long large_consumed = 0;
+
+  long total_requested = 0;
+  long total_consumed = 0;
+  int i;
+  for (i = 0; i < nobjects; i++) {
+    int size = minsize + rand_r(&seed) % (maxsize - minsize + 1);
+    objs[i] = (char *)mm_malloc(size);
+    if (objs[i] == NULL) {
+      printf ("Out of memory after %d objects\n", i);
+      break;
+    }
+    total_requested += size;
+    int sizeclass = find_size_class(size);
+    if (sizeclass < 0) {
+      large_count++;
+      large_requested += size;
+      large_consumed += large_span_size(size);
+      total_consumed += large_span_size(size);
+      continue;
+    }
+    count[sizeclass]++;
+    requested[sizeclass] += size;
+    total_consumed += SIZE_CLASSES[sizeclass];
+  }
+
+  printf ("%10s %10s %14s %14s %9s %9s\n", "class", "objects", "requested", "consumed", "waste %", "worst %");
+  for (i = 0; i < NUM_SIZE_CLASSES; i++) {
+    if (count[i] == 0) {
+      continue;
+    }
+    long consumed = count[i] * SIZE_CLASSES[i];
+    // the worst fit is one byte more than the class below
+    size_t smallest = (i == 0) ? 1 : SIZE_CLASSES[i-1] + 1;
+    printf ("%10lu %10ld %14ld %14ld %9.2f %9.2f\n", (unsigned long)SIZE_CLASSES[i], count[i],
+	    requested[i], consumed, 100.0 * (consumed - requested[i]) / consumed,
+	    100.0 * (SIZE_CLASSES[i] - smallest) / SIZE_CLASSES[i]);
+  }
+
+  if (large_count > 0) {
+    printf ("%10s %10ld %14ld %14ld %9.2f\n", "large", large_count, large_requested,
+	    large_consumed, 100.0 * (large_consumed - large_requested) / large_consumed);
+  }
+
+  long used = mem_usage() - base_usage;
+  printf ("Requested = %ld bytes, consumed by blocks = %ld bytes, waste %.2f%%\n",
+	  total_requested, total_consumed, 100.0 * (total_consumed - total_requested) / total_consumed);
+  printf ("Memory used = %ld bytes, ratio %f\n", used, (double)used / total_requested);
+
+  for (i = 0; i < nobjects && objs[i] != NULL; i++) {
+    mm_free(objs[i]);
+  }
+  return 0;
+}
@@ -12,6 +12,7 @@
 
 #include "mm_thread.h"
 #include "malloc.h"
+#include "memlib.h"
 
 typedef void * LPVOID;
 typedef long long LONGLONG;
@@ -344,7 +345,7 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
   _int64        ticks ;
   double        rate_1=0, rate_n ;
   double        reqd_space ;
-  int           used_space ;
+  long          used_space ;
   int           prevthreads ;
   int           i ;
 
@@ -427,7 +428,8 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
       used_space = mem_usage();
       
       printf ("Throughput = %8.0f operations per second.\n", sum_allocs / duration);
-      printf ("Memory used = %d bytes, required %.0lf, ratio %lf\n",used_space,reqd_space,used_space/reqd_space);
+      printf ("Memory used = %ld bytes, required %.0lf, ratio %lf\n",used_space,reqd_space,used_space/reqd_space);
+      printf ("Memory committed = %ld bytes, reserved %ld bytes\n",mem_committed(),mem_reserved());
 
 #if 0
       printf("%2d ", num_threads ) ;
@@ -0,0 +1,111 @@
+/*
+ * libc.c
+ *
+ * The allocation calls of malloc.h on top of the C library's malloc, so
+ * the benchmarks can be built against it as a baseline (make
+ * <benchmark>-libc, and bench.sh). It takes the place of memlib.c as
+ * well: mem_usage and friends report how much the C library has taken
+ * from the OS, by mallinfo2, counting every arena and mmapped chunk.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "malloc.h"
+#include "memlib.h"
+
+
+int mm_init (void)
+{
+    return 0;
+}
+
+void *mm_malloc (size_t size)
+{
+    return malloc(size);
+}
+
+void mm_free (void *ptr)
+{
+    free(ptr);
+}
+
+void mm_free_sized (void *ptr, size_t size)
+{
+    free(ptr);
+}
+
+void *mm_realloc (void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+void *mm_calloc (size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+void *mm_memalign (size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int mm_posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+    return posix_memalign(memptr, alignment, size);
+}
+
+void *mm_aligned_alloc (size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+size_t mm_usable_size (void *ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+/* the C library has no batch calls, so these are one call per block */
+int mm_malloc_batch (size_t size, int n, void **out)
+{
+    int i;
+    for (i = 0; i < n; i++) {
+        if ((out[i] = malloc(size)) == NULL)
+            break;
+    }
+    return i;
+}
+
+void mm_free_batch (void **ptrs, int n)
+{
+    int i;
+    for (i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+
+int mem_pagesize (void)
+{
+    return getpagesize();
+}
+
+/* Bytes the C library has from the OS right now: sbrk and mmap for
+ * arenas, plus chunks that were mmapped on their own. Unlike memlib's,
+ * this goes down again when memory is given back */
+long mem_usage (void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+long mem_committed (void)
+{
+    return mem_usage();
+}
+
+long mem_reserved (void)
+{
+    return mem_usage();
+}
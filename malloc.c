@@ -1,13 +1,28 @@
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <pthread.h>
-#include <math.h>
 #include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #include "memlib.h"
 #include "malloc.h"
 #include "mm_thread.h"
+#include "tsc.h"
+
+// the per cpu caches need restartable sequences, which glibc registers
+// for every thread on linux, and a bit of x86-64 assembly
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <stddef.h>
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+#endif
 
 
 name_t myname = {
@@ -35,50 +50,147 @@ name_t myname = {
 // Wrappers for locking and unlocking
 // ---------------------------------------------------------------------
 
-// the mem_sbrk lock
-#if 0
-typedef pthread_spinlock_t mem_sbrk_lock_t;
-#define MEM_SBRK_LOCK_INIT(lock) pthread_spin_init(lock, PTHREAD_PROCESS_SHARED)
-#define LOCK_MEM_SBRK(lock) pthread_spin_lock(lock)
-#define UNLOCK_MEM_SBRK(lock) pthread_spin_unlock(lock)
+// building with -DLOCK_PROFILE makes every lock below count how often
+// it's taken, how often it was already held by someone else, and how
+// many cycles were spent waiting for it then. The counts are kept under
+// the lock they're for, and reported at exit
+#ifdef LOCK_PROFILE
+struct lock_profile_t {
+	unsigned long acquisitions;
+	unsigned long contended;
+	u_int64_t wait_cycles;
+};
+typedef struct lock_profile_t lock_profile;
+
+// take lock, and only time the wait if it's actually held
+void profiled_lock(pthread_mutex_t *lock, lock_profile *prof) {
+	if (pthread_mutex_trylock(lock) != 0) {
+		u_int64_t start = read_counter();
+		pthread_mutex_lock(lock);
+		prof->wait_cycles += read_counter() - start;
+		++prof->contended;
+	}
+	++prof->acquisitions;
+}
+#define PROFILED_LOCK(lock, prof) profiled_lock(lock, prof)
 #else
-typedef pthread_mutex_t mem_sbrk_lock_t;
-#define MEM_SBRK_LOCK_INIT(lock) pthread_mutex_init(lock, NULL)
-#define LOCK_MEM_SBRK(lock) pthread_mutex_lock(lock)
-#define UNLOCK_MEM_SBRK(lock) pthread_mutex_unlock(lock)
+#define PROFILED_LOCK(lock, prof) pthread_mutex_lock(lock)
 #endif
 
+// building with -DLATENCY_PROFILE times one mm_malloc and mm_free in
+// every LATENCY_SAMPLE, and keeps a histogram of the cycles each took
+// by group of size classes and by the furthest it had to go, its path:
+// the cache only, a heap's lock, another heap's blocks or a global
+// heap's superblock freed into without one, a superblock moved to or
+// from a global heap, or the page heap. The lock wrappers, and the
+// places those handoffs happen, mark the path of the call being timed
+#define LAT_CACHE 0
+#define LAT_HEAP 1
+#define LAT_REMOTE 2
+#define LAT_GLOBAL 3
+#define LAT_PAGES 4
+#define LAT_PATHS 5
+#ifdef LATENCY_PROFILE
+// the path taken so far by this thread's call, whether it's timed or not
+__thread int LATENCY_PATH_TAKEN = LAT_CACHE;
+#define LATENCY_PATH(p) ((void)(LATENCY_PATH_TAKEN < (p) ? LATENCY_PATH_TAKEN = (p) : 0))
+#else
+#define LATENCY_PATH(p) ((void)0)
+#endif
+
+// the lock of a heap, which covers the superblocks it owns
+#define LOCK_HEAP(h) (LATENCY_PATH(LAT_HEAP), PROFILED_LOCK(&(h)->lock, &(h)->lock_profile))
+#define UNLOCK_HEAP(h) pthread_mutex_unlock(&(h)->lock)
+
+// take the lock of a heap only if nobody holds it, for when another
+// heap's lock may already be held and waiting could deadlock
+#ifdef LOCK_PROFILE
+#define TRYLOCK_HEAP(h) (LATENCY_PATH(LAT_HEAP), pthread_mutex_trylock(&(h)->lock) == 0 ? (++(h)->lock_profile.acquisitions, 1) : 0)
+#else
+#define TRYLOCK_HEAP(h) (LATENCY_PATH(LAT_HEAP), pthread_mutex_trylock(&(h)->lock) == 0)
+#endif
+
+// the page heap lock
+#define LOCK_PAGEHEAP() (LATENCY_PATH(LAT_PAGES), PROFILED_LOCK(&pageheap_lock, &PAGEHEAP_LOCK_PROFILE))
+#define UNLOCK_PAGEHEAP() pthread_mutex_unlock(&pageheap_lock)
+
 
 // ---------------------------------------------------------------------
 // Shared global variables, some of which are set during mm_init
 // ---------------------------------------------------------------------
 
-// Lock for mem_sbrk
-mem_sbrk_lock_t mem_sbrk_lock;
+// mem_sbrk needs no lock of its own, it bumps the break atomically
+
+#ifdef LOCK_PROFILE
+lock_profile PAGEHEAP_LOCK_PROFILE;
+
+void lock_profile_report();
+#endif
 
 #define CACHELINE_SIZE 64
-#define SUPERBLOCK_SIZE 4096
 
-// our size classes will be powers of this
-#define SIZE_CLASS_BASE 2
+// the page heap hands out memory in multiples of this
+#define PAGE_SIZE 4096
+
+// superblocks are a whole number of pages, picked per size class so that
+// each holds about SUPERBLOCK_TARGET_BLOCKS blocks, but no bigger than
+// SUPERBLOCK_MAX_KB (see init_superblock_sizes for overriding them)
+#define SUPERBLOCK_TARGET_BLOCKS 32
+#define SUPERBLOCK_MAX_KB 64
+
+// no superblock has more blocks than one page of the smallest size class
+// (superblocks of small classes are a single page anyway)
+#define SUPERBLOCK_MAX_BLOCKS (PAGE_SIZE / MIN_SIZE_CLASS)
+
+// the most pages a superblock may have, so the page offsets of
+// SUPERBLOCK_LEAD fit in a byte
+#define SUPERBLOCK_MAX_PAGES 255
+
+// heaps take pages for new superblocks from the page heap this many KB
+// at a time and carve them up under their own lock (CAMEL_CHUNK_KB
+// overrides it, 0 takes every superblock from the page heap)
+#define SUPERBLOCK_CHUNK_KB 256
+
+// every power of two range is split into this many evenly spaced size classes
+// so a request wastes less than 1/SIZE_CLASS_STEPS of its size, e.g. 8 gives
+// under 12.5% (1 gives plain powers of two)
+#define SIZE_CLASS_STEPS 8
+
+// all size classes are multiples of this, which caps how fine the small ones get
+#define SIZE_CLASS_QUANTUM 8
 
 // the smallest size we'll start with (in bytes)
 #define MIN_SIZE_CLASS 8
 
 // an upper bound on the biggest size class
-#define MAX_SIZE_CLASS (DSEG_MAX)
+// anything bigger than this is a large object and gets its own span of pages
+#define MAX_SIZE_CLASS (PAGE_SIZE / 2)
 
 // an upper bound on the number of size classes we'll have
-#define MAX_NUM_SIZE_CLASS 128
+// it has to fit in the unsigned char lookup tables below
+#define MAX_NUM_SIZE_CLASS 255
 
 // array of the sizes of the size classes
 size_t *SIZE_CLASSES = NULL;
 
+// sizes up to this are looked up directly in SIZE_CLASS_LOOKUP
+#define SIZE_LOOKUP_MAX 1024
+
+// size classes of small sizes, indexed by the size in 8 byte granules rounded up
+unsigned char *SIZE_CLASS_LOOKUP = NULL;
+
+// for bigger sizes, indexed by the bit length of size-1, the first
+// size class that is bigger than the previous power of two
+unsigned char *POW2_SIZE_CLASS = NULL;
+
 // number of size classes that we have
 int NUM_SIZE_CLASSES = 0;
 
-// how much space is available in a superblock for allocation
-size_t SB_AVAILABLE = 0;
+// how many bytes the superblocks of each size class have
+size_t *SUPERBLOCK_SIZES = NULL;
+
+// how many pages a heap takes from the page heap at a time for its superblocks
+size_t SUPERBLOCK_CHUNK_PAGES = 0;
 
 // if a heap has less or exactly this number of superblocks
 // then it won't give any of them up to the global heap
@@ -87,6 +199,10 @@ size_t SB_AVAILABLE = 0;
 // the denominator for fullness buckets e.g. 1/8 full, 2/8 full, etc...
 #define FULLNESS_DENOM 3
 
+// for each size class, FULLNESS_DENOM entries where entry i is the most
+// bytes a superblock in fullness bucket i may have allocated
+size_t *FULLNESS_THRESHOLDS = NULL;
+
 // size of heap metadata structure padded to cache line
 size_t HEAP_SIZE = 0;
 
@@ -97,6 +213,28 @@ heap **HEAPS = NULL;
 
 int NUM_PROCESSORS = 0;
 
+// the most NUMA nodes we keep apart
+#define MAX_NUMA_NODES 64
+
+// how many NUMA nodes there are, or how many CAMEL_NUMA_NODES says to
+// pretend there are, and the node of every cpu
+int NUM_NODES = 1;
+int *CPU_NODE = NULL;
+
+// every node has a global heap, so there are NUM_PROCESSORS + NUM_NODES heaps,
+// plus the thread heaps made so far if they're on
+int NUM_HEAPS = 0;
+
+// the most heaps there can be for threads of their own
+#define MAX_THREAD_HEAPS 4096
+
+// whether every thread gets a heap of its own instead of sharing its
+// cpu's, which CAMEL_THREAD_HEAPS=1 asks for
+int THREAD_HEAPS_ON = 0;
+
+// thread heaps are numbered from here up to NUM_HEAPS
+int FIRST_THREAD_HEAP = 0;
+
 // pointer to where superblocks start and the heap structures end
 char *SUPERBLOCK_START = NULL;
 
@@ -114,20 +252,29 @@ size_t round_to_cache(size_t s) {
 	return round_to(s, CACHELINE_SIZE);
 }
 
-size_t round_to_superblock(size_t s) {
-	return round_to(s, SUPERBLOCK_SIZE);
-}
 
 // ---------------------------------------------------------------------
 // Superblock structure
 // ---------------------------------------------------------------------
 
+/*
+ * Superblocks keep track of their free blocks in one of two ways:
+ * a freelist threaded through the free blocks themselves, or, when
+ * built with -DSUPERBLOCK_BITMAP, a bitmap in the header with one bit per
+ * block. The bitmap never writes to a block that's being freed, so a free
+ * doesn't pull a cold block into the cache, and it catches double frees.
+ */
+
+#ifdef SUPERBLOCK_BITMAP
+// enough bits for every block of the smallest size class
+#define BITMAP_WORDS ((SUPERBLOCK_MAX_BLOCKS + 63) / 64)
+#endif
+
 // we want to make sure the freelist is at most 8 bytes so we don't use pointers
 struct freelist_t {
 	/* next isn't a pointer to the next freelist node
 	 * instead, it's an offset to the next freelist node, from the start of the superblock
-	 * because the header is at the start of the superblock, a value of 0 is invalid
-	 * so 0 will be used in a similar manner to NULL for pointers
+	 * FREELIST_END is never a valid offset, so it's used in a similar manner to NULL for pointers
 	 */
 	unsigned int next;
 	
@@ -141,125 +288,288 @@ struct freelist_t {
 };
 typedef struct freelist_t freelist;
 
+#define FREELIST_END ((unsigned int)-1)
+
+/*
+ * The descriptor of a superblock. Descriptors live in a table of their
+ * own, SUPERBLOCK_META, indexed by the page number of the superblock's
+ * first page from SUPERBLOCK_START, so a superblock's memory is all blocks, and frees
+ * don't write to a line that shares its cache line with user data.
+ * Each one gets a cache line (or two) to itself so superblocks of
+ * different heaps don't false-share their descriptors either.
+ * All the fields of a superblock are protected by the lock of the heap
+ * that owns it, except while a global heap owns it: global heaps have
+ * no lock for their superblocks, and only gfree and gnext change then.
+ */
 struct superblock_t {
-	// Lock for this superblock
-	// this lock is used to protect all fields except next,prev,bucketnum
-	pthread_mutex_t lock;
-	
 	// next in the doubly linked list in the free bucket
 	struct superblock_t *next;
 	
 	// previous in the doubly linked list
 	struct superblock_t *prev;
 	
+#ifdef SUPERBLOCK_BITMAP
+	// bit i%64 of word i/64 is set if block i is free
+	unsigned long freemap[BITMAP_WORDS];
+	
+	// how many bits are set in freemap
+	int nfree;
+#else
 	// head of the freelist of this superblock
 	freelist *head;
+#endif
 	
 	// number of bytes of allocated memory
 	size_t allocated;
 	
 	// which heap owns this
+	// it only changes with that heap locked, or if it's a global heap,
+	// with the heap it goes to or comes from locked, after gfree is
+	// opened or before it's closed. frees read it without a lock to find
+	// out where to send their blocks
 	int owner;
 	
+	// the blocks freed into this while a global heap owns it (see
+	// GFREE_LINK_BITS), or GFREE_CLOSED while another heap does
+	unsigned long gfree;
+	
+	// the next superblock down in a global heap's stack (see gstack)
+	unsigned int gnext;
+	
 	// which size class this superblock is 
 	int size_class;
 	
 	// which bucket this superblock is in 
 	int bucketnum;
 	
-	// how many are in the array, if this is the first of an array
-	// this will be 1 for a regular single superblock
-	int n;
-	
-};
+} __attribute__((aligned(CACHELINE_SIZE)));
 typedef struct superblock_t superblock;
 
-// size of the superblock header
-#define SUPERBLOCK_HSIZE (sizeof(superblock))
+// the descriptor of every superblock there could be
+superblock *SUPERBLOCK_META = NULL;
+
+// a superblock's gfree while a global heap owns it: the blocks freed
+// into it since, linked through their first word. The low
+// GFREE_LINK_BITS hold the first one's offset from SUPERBLOCK_START
+// over 8, plus 1 (0 if there are none), and the rest how many there are.
+// A heap that takes the superblock swaps in GFREE_CLOSED, so a free can
+// tell it has to go to the new owner instead
+#define GFREE_LINK_BITS 34
+#define GFREE_LINK_MASK ((1UL << GFREE_LINK_BITS) - 1)
+#define GFREE_CLOSED (~0UL)
+
+// for every page in a superblock, how many pages into the superblock it is,
+// so find_superblock can get from any block to the descriptor
+unsigned char *SUPERBLOCK_LEAD = NULL;
 
 // if a superblock has less than threshold allocated, we move it to global heap
-#define ALLOC_THRESHOLD (SUPERBLOCK_SIZE/8)
+#define ALLOC_THRESHOLD(sizeclass) (SUPERBLOCK_SIZES[sizeclass]/8)
+
+// the memory of the superblock with descriptor sb
+// since superblocks are page aligned, every block is aligned to the
+// biggest power of two its size is a multiple of (up to a page), e.g.
+// blocks of 192 bytes are 64 byte aligned
+char *superblock_data(superblock *sb) {
+	return SUPERBLOCK_START + (sb - SUPERBLOCK_META) * PAGE_SIZE;
+}
+
+// whether a superblock has no free blocks left
+int superblock_full(superblock *sb) {
+#ifdef SUPERBLOCK_BITMAP
+	return sb->nfree == 0;
+#else
+	return sb->head == NULL;
+#endif
+}
 
 // initialize a superblock
-// given the heap that owns this, what size class this is, and how many in the array
-// given a mem_sbrk region of memory that is assumed to fit
-int init_superblock(int owner, int size_class, int n, char *sb) {
-	assert(owner >= 0 && owner <= NUM_PROCESSORS);
+// given the heap that owns this and what size class this is
+// given SUPERBLOCK_SIZES[size_class] bytes of memory from the page heap
+// returns its descriptor
+superblock *init_superblock(int owner, int size_class, char *sb) {
+	assert(owner >= 0 && owner < NUM_HEAPS);
 	assert(size_class >= 0 && size_class < NUM_SIZE_CLASSES);
-	assert(n > 0);
 	assert(sb != NULL);
 	
-	// initialize the header
-	superblock *header = (superblock*)sb;
+	// initialize the descriptor
+	superblock *header = &SUPERBLOCK_META[(sb - SUPERBLOCK_START) / PAGE_SIZE];
 	header->owner = owner;
+	header->gfree = GFREE_CLOSED;
+	header->gnext = 0;
 	header->bucketnum = -2; // some invalid value that needs to be overridden
 	header->size_class = size_class;
-	header->n = n;
 	header->next = NULL;
 	header->prev = NULL;
 	header->allocated = 0;
-	pthread_mutex_init(&header->lock, NULL);
 	
-	// initialize the freelist with one big free chunk
-	size_t freestart = round_to(SUPERBLOCK_HSIZE, 8);
 	size_t class_size = SIZE_CLASSES[size_class];
-	// assume we have enough memory for at least one block
-	assert((char*)sb + freestart + class_size <= (sb + n * SUPERBLOCK_SIZE));
-	// initialize the first block
-	freelist *head = (freelist*)(sb + freestart);
 	// find out how many blocks can fit
-	head->n = ((n-1) * SUPERBLOCK_SIZE + SB_AVAILABLE) / class_size;
-	head->next = 0;
+	size_t n = SUPERBLOCK_SIZES[size_class] / class_size;
+	assert(n >= 1 && n <= SUPERBLOCK_MAX_BLOCKS);
+#ifdef SUPERBLOCK_BITMAP
+	// every block starts out free
+	assert(n <= BITMAP_WORDS * 64);
+	int i;
+	for (i = 0; i < BITMAP_WORDS; ++i) {
+		size_t bits = n > i * 64 ? n - i * 64 : 0;
+		header->freemap[i] = bits >= 64 ? ~0UL : (1UL << bits) - 1;
+	}
+	header->nfree = n;
+#else
+	// initialize the freelist with one big free chunk
+	freelist *head = (freelist*)sb;
+	head->n = n;
+	head->next = FREELIST_END;
 	header->head = head;
-	return 0;
+#endif
+	return header;
 }
 
-void debug_superblock(char *ptr) {
+void debug_superblock(superblock *sb) {
+	char *ptr = superblock_data(sb);
 	printf("-------------------------------------------------------\n");
-	printf("header size: %u\n", SUPERBLOCK_HSIZE);
-	size_t freestart = round_to(SUPERBLOCK_HSIZE, 8);
-	printf("freestart: %u\n", freestart);
+	printf("descriptor size: %u\n", (unsigned)sizeof(superblock));
+	printf("superblock: %p\n", ptr);
 	
-	superblock *sb = (superblock*)ptr;
 	printf("Owner:%d\n", sb->owner);
 	printf("Bucketnum:%d\n", sb->bucketnum);
-	printf("Size class:%d, %u\n", sb->size_class, SIZE_CLASSES[sb->size_class]);
-	printf("Array n:%d\n", sb->n);
-	printf("freelist:%p %d\n", sb->head, (int)((char*)sb->head - ptr));
-	printf("allocated:%u\n", sb->allocated);
-	printf("prev:%p %d\n", sb->prev, (char*)sb->prev-SUPERBLOCK_START);
-	printf("next:%p %d\n", sb->next, (char*)sb->next-SUPERBLOCK_START);
+	printf("Size class:%d, %zu\n", sb->size_class, SIZE_CLASSES[sb->size_class]);
+	printf("allocated:%zu\n", sb->allocated);
+	printf("prev:%p %d\n", sb->prev, (int)(sb->prev != NULL ? sb->prev - SUPERBLOCK_META : -1));
+	printf("next:%p %d\n", sb->next, (int)(sb->next != NULL ? sb->next - SUPERBLOCK_META : -1));
+#ifdef SUPERBLOCK_BITMAP
+	// print the bitmap
+	printf("free blocks:%d\n", sb->nfree);
+	int i;
+	for (i = 0; i < BITMAP_WORDS; ++i) {
+		printf("freemap %2d: %016lx\n", i, sb->freemap[i]);
+	}
+#else
+	printf("freelist:%p %d\n", sb->head, sb->head != NULL ? (int)((char*)sb->head - ptr) : -1);
 	// print the freelist
 	freelist *head = sb->head;
-	while (head != NULL && head != (freelist*)ptr) {
+	while (head != NULL) {
 		printf("curr %5u, n: %u, next :%5u\n", (unsigned)((char*)head - ptr), head->n, head->next);
-		head = (freelist*)(ptr + head->next);
+		head = head->next != FREELIST_END ? (freelist*)(ptr + head->next) : NULL;
 	}
+#endif
 }
 
 // ---------------------------------------------------------------------
 // Heap structure
 // ---------------------------------------------------------------------
 
+// what a heap has done with one size class, for mm_stats_heap
+// kept under the heap's lock, which the counted paths hold anyway
+struct heap_counters_t {
+	unsigned long mallocs;
+	unsigned long frees;
+	unsigned long remote_frees;
+	unsigned long from_global;
+	unsigned long to_global;
+	unsigned long new_superblocks;
+	unsigned long released;
+	unsigned long from_other_node;
+};
+typedef struct heap_counters_t heap_counters;
+
+/*
+ * A lock free (Treiber) stack of the superblocks of one size class in a
+ * global heap, linked through their gnext.
+ * top holds the index in SUPERBLOCK_META of the top superblock plus 1
+ * (0 if it's empty) in its low 32 bits, and a tag in the high 32 that
+ * goes up with every change, so a pop can't mistake the stack for the
+ * same one it looked at if the top was popped and pushed back meanwhile.
+ */
+struct gstack_t {
+	unsigned long top;
+	
+	// how many superblocks are on it, give or take those on their way
+	// on or off, for the statistics
+	long depth;
+} __attribute__((aligned(CACHELINE_SIZE)));
+typedef struct gstack_t gstack;
+
 struct heap_t {
-	// this lock is for everything in here and for prev,next,bucketnum in superblock
+	// this lock is for everything in here but remote, and for the superblocks this heap owns
 	pthread_mutex_t lock;
+#ifdef LOCK_PROFILE
+	lock_profile lock_profile;
+#endif
+	
+	// blocks freed by other cpus that still have to go back to our superblocks,
+	// linked through their first word. pushed onto without the lock and
+	// taken all at once with the lock
+	void *remote __attribute__((aligned(CACHELINE_SIZE)));
 	
 	// array of fullness buckets
 	// ordered from most full to least full
 	superblock **buckets[FULLNESS_DENOM];
 	
+	// counters for each size class, after the buckets
+	heap_counters *counters;
+	
 	// stats
 	int num_superblocks;
+	
+	// the NUMA node this heap is for
+	int node;
+	
+	// whether this is that node's global heap
+	int global;
+	
+	// whether this is a thread's own heap, and whether that thread has
+	// exited, leaving the heap for the next new thread
+	int thread;
+	int retired;
+	
+	// a global heap keeps its superblocks on these instead of in its
+	// buckets, one per size class, and its lock only covers trimming them
+	struct gstack_t *stacks;
+	
+	// pages taken from the page heap that haven't been made into
+	// superblocks yet, carved off the front
+	char *chunk;
+	size_t chunk_pages;
 };
 //typedef struct heap_t heap;
 
-heap *new_heap() {
-	// allocate it from the OS
-	heap *h = (heap*)mem_sbrk(HEAP_SIZE);
-	assert(h != NULL);
-	
+// this thread's heap when thread heaps are on, 0 until it takes one,
+// and -1 once it can't have one (it's exiting, or they're all taken)
+__thread int MY_HEAP = 0;
+
+// used to retire a thread's heap when it exits
+pthread_key_t heap_key;
+
+// held while a new thread heap is made
+pthread_mutex_t thread_heaps_lock;
+
+void heap_release(void *arg);
+
+// the heap number of the global heap of a node
+// node 0's is heap 0, and the other nodes' come after the per cpu heaps
+int global_heap(int node) {
+	return node == 0 ? 0 : NUM_PROCESSORS + node;
+}
+
+int is_global_heap(int heapnum) {
+	return heapnum == 0 || (heapnum > NUM_PROCESSORS && heapnum < FIRST_THREAD_HEAP);
+}
+
+// set up a heap in the HEAP_SIZE bytes at h
+heap *init_heap(heap *h, int node, int global) {
 	pthread_mutex_init(&h->lock, NULL);
+	h->node = node;
+	h->global = global;
+	h->thread = 0;
+	h->retired = 0;
+	h->stacks = NULL;
+	h->chunk = NULL;
+	h->chunk_pages = 0;
+#ifdef LOCK_PROFILE
+	memset(&h->lock_profile, 0, sizeof(lock_profile));
+#endif
+	h->remote = NULL;
 	h->num_superblocks = 0;
 	
 	// initialize fullness buckets
@@ -272,10 +582,19 @@ heap *new_heap() {
 			h->buckets[i][j] = NULL;
 		}
 	}
+	h->counters = (heap_counters*)((char*)h + sizeof(heap) + FULLNESS_DENOM*free_bucket_size);
+	memset(h->counters, 0, NUM_SIZE_CLASSES*sizeof(heap_counters));
 	
 	return h;
 }
 
+heap *new_heap(int node, int global) {
+	// allocate it from the OS
+	heap *h = (heap*)mem_sbrk(HEAP_SIZE);
+	assert(h != NULL);
+	return init_heap(h, node, global);
+}
+
 void debug_heap(char *ptr) {
 	heap *h = (heap*)ptr;
 	printf("-------------------------------------------------------\n");
@@ -295,425 +614,3229 @@ void debug_heap(char *ptr) {
 }
 
 // ---------------------------------------------------------------------
-// Helper functions for finding the right size class
+// Page heap structure
 // ---------------------------------------------------------------------
 
-// find which size class s falls into
-int find_size_class(size_t s) {
-	if (s <= MIN_SIZE_CLASS) {
-		return 0;
-	}
-	// otherwise bigger than the min size class
-	double log_base = log((double)s / MIN_SIZE_CLASS) / log(SIZE_CLASS_BASE);
-	int candidate = (int)ceil(log_base);
-	
-	if (candidate >= NUM_SIZE_CLASSES) {
-		// too big of a request
-		return -1;
-	}
-	// check if previous class can accomdate first
-	if (candidate > 0 && SIZE_CLASSES[candidate-1] >= s) {
-		return candidate - 1;
-	} else {
-		// otherwise we know candidate can fit
-		return candidate;
-	}
-}
+/*
+ * Everything past SUPERBLOCK_START is handed out by the page heap in
+ * spans of whole pages. Superblocks are spans of one or more pages, and objects
+ * too big for any size class get a span of their own.
+ * Free spans are kept in one list in address order and are merged with
+ * their free neighbours as soon as they are freed.
+ *
+ * Free pages are given back to the OS lazily. Once more than
+ * PAGEHEAP_DIRTY_HIGH free pages may still be resident, and that has
+ * been the case for PAGEHEAP_RELEASE_DELAY ms, free spans are released
+ * until we're down to PAGEHEAP_DIRTY_LOW, so memory that is about to be
+ * reused doesn't bounce between the OS and us.
+ */
 
-// ---------------------------------------------------------------------
-// Helper functions for mm_init
-// ---------------------------------------------------------------------
+// defaults for the release policy, see init_page_heap for overriding them
+#define PAGEHEAP_RELEASE_DELAY_MS 1000
+#define PAGEHEAP_DIRTY_HIGH_KB 8192
+#define PAGEHEAP_DIRTY_LOW_KB 2048
 
-// initialize all the size classes
-int init_size_classes() {
-	// allocate enough to hold MAX_NUM_SIZE_CLASS many sizes
-	size_t request_size = round_to_cache(sizeof(size_t) * MAX_NUM_SIZE_CLASS);
-	SIZE_CLASSES = mem_sbrk(request_size);
-	if (SIZE_CLASSES == NULL) {
-		return -1;
-	}
+struct span_t {
+	// how many pages this span covers
+	size_t npages;
 	
-	// calculate the size of each size class
-	double size = MIN_SIZE_CLASS;
-	NUM_SIZE_CLASSES = 0;
-	while ((size_t)ceil(size) <= MAX_SIZE_CLASS && NUM_SIZE_CLASSES < MAX_NUM_SIZE_CLASS) {
-		SIZE_CLASSES[NUM_SIZE_CLASSES] = (size_t)ceil(size);
-		
-		++NUM_SIZE_CLASSES;
-		size *= SIZE_CLASS_BASE;
-	}
-	/*
-	// debugging
-	long n;
-	for (n = 0; n < NUM_SIZE_CLASSES; ++n) {
-		printf("%ld: %u\n", n, SIZE_CLASSES[n]);
-	}
-	*/
-	return request_size;
+	// nonzero if this span is in the free list
+	int free;
+	
+	// while free, at most this many of its pages are resident,
+	// not counting the first one, which holds this header
+	size_t dirty;
+	
+	// free list pointers, only used while the span is free
+	struct span_t *next;
+	struct span_t *prev;
+};
+typedef struct span_t span;
+
+// a large object starts this far into its span
+#define LARGE_HSIZE (round_to_cache(sizeof(span)))
+
+// the span covering each page, indexed by page number from SUPERBLOCK_START
+// only the first and last page of a span are kept up to date, and
+// all pages in superblocks map to NULL
+span **PAGE_MAP = NULL;
+
+// how many pages PAGE_MAP has room for
+size_t PAGE_MAP_SIZE = 0;
+
+// how many pages past SUPERBLOCK_START have been taken from mem_sbrk
+size_t PAGEHEAP_TOP = 0;
+
+// free spans in address order, and the last of them
+span *PAGEHEAP_FREE = NULL;
+span *PAGEHEAP_FREE_TAIL = NULL;
+
+// the release policy, in ms and pages
+unsigned long PAGEHEAP_RELEASE_DELAY = 0;
+size_t PAGEHEAP_DIRTY_HIGH = 0;
+size_t PAGEHEAP_DIRTY_LOW = 0;
+
+// sum of dirty over the free list
+size_t PAGEHEAP_DIRTY = 0;
+
+// when PAGEHEAP_DIRTY went over PAGEHEAP_DIRTY_HIGH, 0 if it's not over
+unsigned long PAGEHEAP_DIRTY_SINCE = 0;
+
+// counters for mm_stats_pages
+unsigned long PAGEHEAP_LARGE_MALLOCS = 0;
+unsigned long PAGEHEAP_LARGE_FREES = 0;
+unsigned long PAGEHEAP_SBRK_CALLS = 0;
+
+// this lock is for the free list, PAGE_MAP, PAGEHEAP_TOP, all span headers
+// and the counters
+pthread_mutex_t pageheap_lock;
+
+size_t page_number(void *ptr) {
+	return ((char *)ptr - SUPERBLOCK_START) / PAGE_SIZE;
+}
+
+char *page_address(size_t page) {
+	return SUPERBLOCK_START + page * PAGE_SIZE;
 }
 
+// a cheap millisecond clock for the release policy
+unsigned long pageheap_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
 
+// find the span the given pointer was allocated from, NULL if it's in a superblock
+// only valid for pointers into the first page of a span, or to a large
+// object from large_memalign
+span *find_span(void *ptr) {
+	return PAGE_MAP[page_number(ptr)];
+}
 
-// ---------------------------------------------------------------------
-// mm_init, mm_malloc, mm_freechar
-// ---------------------------------------------------------------------
+// point the first and last page of the span at it
+// assumes pageheap_lock has been obtained
+void map_span(span *s, span *value) {
+	size_t first = page_number(s);
+	PAGE_MAP[first] = value;
+	PAGE_MAP[first + s->npages - 1] = value;
+}
 
-int mm_init (void) {
-	MEM_SBRK_LOCK_INIT(&mem_sbrk_lock);
-	
-	if (mem_init()) {
-		return -1;
+// unlink s from the free list
+// assumes pageheap_lock has been obtained
+void remove_free_span(span *s) {
+	assert(s->free);
+	if (s->prev != NULL) {
+		s->prev->next = s->next;
+	} else {
+		PAGEHEAP_FREE = s->next;
 	}
-	int size_classes_size = init_size_classes();
-	if (size_classes_size < 0) {
-		return -1;
+	if (s->next != NULL) {
+		s->next->prev = s->prev;
+	} else {
+		PAGEHEAP_FREE_TAIL = s->prev;
 	}
-	
-	// make sure to pad the header if necessary to be 8 byte aligned
-	SB_AVAILABLE = SUPERBLOCK_SIZE - round_to(SUPERBLOCK_HSIZE, 8);
-	
-	// calculate how big the the fullness buckets need to be;
-	size_t num_free_buckets = (FULLNESS_DENOM) * NUM_SIZE_CLASSES;
-	HEAP_SIZE = round_to_cache(sizeof(heap) + num_free_buckets * sizeof(superblock*));
-	
-	// calculate number of processors
-	NUM_PROCESSORS = getNumProcessors();
-	
-	// make the shared array of heaps
-	// heap 0 is the global heap
-	size_t num_heaps = NUM_PROCESSORS+1;
-	size_t heaps_array_size = round_to_cache(num_heaps*sizeof(heap*));
-	HEAPS = mem_sbrk(heaps_array_size);
-	assert(HEAPS != NULL);
-	
-	// initialize all heaps
-	int i;
-	for (i = 0; i < num_heaps; ++i) {
-		HEAPS[i] = new_heap();
-		assert(HEAPS[i] != 0);
+	s->free = 0;
+}
+
+// link s into the free list, keeping it in address order
+// assumes pageheap_lock has been obtained
+void insert_free_span(span *s) {
+	span *prev = NULL;
+	span *curr = PAGEHEAP_FREE;
+	while (curr != NULL && curr < s) {
+		prev = curr;
+		curr = curr->next;
 	}
-	
-	//void test_heap();
-	//test_heap();
-	
-	//void test_superblock();
-	//test_superblock();
-	
-	int total_overhead = size_classes_size + heaps_array_size + HEAP_SIZE*(NUM_PROCESSORS+1);
-	
-DEBUG("Page size: %db\n", mem_pagesize());
-DEBUG("Overhead: %db\n", total_overhead);
-	
-	// pad out the rest so the superblocks will start page aligned
-	size_t padding = total_overhead % mem_pagesize();
-	if (padding > 0) {
-		padding = mem_pagesize() - padding;
+	s->prev = prev;
+	s->next = curr;
+	if (prev != NULL) {
+		prev->next = s;
+	} else {
+		PAGEHEAP_FREE = s;
 	}
-	mem_sbrk(padding);
-	SUPERBLOCK_START = total_overhead + padding + dseg_lo;
-	
-DEBUG("Superblock start: %db\n", SUPERBLOCK_START - dseg_lo);
-	
-	return 0;
+	if (curr != NULL) {
+		curr->prev = s;
+	} else {
+		PAGEHEAP_FREE_TAIL = s;
+	}
+	s->free = 1;
+}
+
+// merge the free span from, which comes right after into, into into
+// the page holding the header of from becomes a dirty page of into
+void absorb_span(span *into, span *from) {
+	into->npages += from->npages;
+	into->dirty += from->dirty + 1;
+	++PAGEHEAP_DIRTY;
 }
 
 /*
- * Helper function for allocating a free block.
- * It assumes the given superblock is not completely full.
- * It gets a free block from the superblock and updates the freelist
- * and returns a pointer to the block.
- * Assumes lock on superblock freeblk has been acquired.
+ * Puts s back into the free list, merging it with the free spans on
+ * either side of it. dirty is how many of its pages past the first one
+ * may be resident.
+ * Returns the merged span.
+ * Assumes pageheap_lock has been obtained.
  */
-void* allocate_block(int sclass, superblock *freeblk) {
-	
-	void *ret;
-	freelist *freespace = freeblk->head;
-	assert(freespace != NULL);
-	if (freespace->n > 1){
-		--freespace->n;
-		ret = (char *)freespace + (freespace->n*SIZE_CLASSES[sclass]);
-	} else { //freespace->n == 1
-		assert(freespace->n == 1);
-		ret = freespace;
-		if (freespace->next != 0) {
-			freeblk->head = (freelist *)((char *)freeblk + freespace->next);
-			assert(freeblk->head != NULL);
-		} else { //freespace->next == 0
-			freeblk->head = NULL;
+span *free_span(span *s, size_t dirty) {
+	PAGEHEAP_DIRTY += dirty;
+	s->dirty = dirty;
+	size_t first = page_number(s);
+	size_t last = first + s->npages - 1;
+	span *before = first > 0 ? PAGE_MAP[first - 1] : NULL;
+	span *after = last + 1 < PAGEHEAP_TOP ? PAGE_MAP[last + 1] : NULL;
+	if (before != NULL && before->free) {
+		// the span before takes this one over and keeps its place in the list
+		absorb_span(before, s);
+		s = before;
+		if (after != NULL && after->free) {
+			remove_free_span(after);
+			absorb_span(s, after);
+		}
+	} else if (after != NULL && after->free) {
+		// this one takes over the span after, and its place in the list
+		absorb_span(s, after);
+		s->prev = after->prev;
+		s->next = after->next;
+		if (s->prev != NULL) {
+			s->prev->next = s;
+		} else {
+			PAGEHEAP_FREE = s;
+		}
+		if (s->next != NULL) {
+			s->next->prev = s;
+		} else {
+			PAGEHEAP_FREE_TAIL = s;
 		}
+		s->free = 1;
+	} else {
+		insert_free_span(s);
+	}
+	map_span(s, s);
+	return s;
+}
+
+/*
+ * Takes npages off the end of the free span s and returns them as a
+ * span of their own, leaving whatever is left over in the free list.
+ * If zeroed isn't NULL, it's set to whether every page of the new span
+ * past the first one is known to be all zeros.
+ * Assumes pageheap_lock has been obtained.
+ */
+span *carve_span(span *s, size_t npages, int *zeroed) {
+	assert(s->free && s->npages >= npages);
+	// pages that aren't dirty have never been touched or have been
+	// given back to the OS, so they read as zeros either way
+	if (zeroed != NULL) {
+		*zeroed = s->dirty == 0;
 	}
-	freeblk->allocated += SIZE_CLASSES[sclass];
+	if (s->npages == npages) {
+		remove_free_span(s);
+		PAGEHEAP_DIRTY -= s->dirty;
+		return s;
+	}
+	s->npages -= npages;
+	// we don't know which pages are resident, so assume the left over ones are
+	size_t dirty = s->dirty < s->npages - 1 ? s->dirty : s->npages - 1;
+	PAGEHEAP_DIRTY -= s->dirty - dirty;
+	s->dirty = dirty;
+	map_span(s, s);
+	span *ret = (span *)(page_address(page_number(s) + s->npages));
+	ret->npages = npages;
+	ret->free = 0;
 	return ret;
-	
 }
 
 /*
- * Search function for finding available superblock.
- * Searches fullness buckets for free block of sizeclass sclass.
- * Returns pointer to said superblock.
- * Assumes lock on heap aheap has been acquired.
+ * Allocates a span of npages pages, first fit from the free list, or
+ * from mem_sbrk if nothing fits. Returns NULL if we're out of memory.
+ * The caller sets up PAGE_MAP for the span it gets back.
+ * zeroed is as for carve_span.
+ * Assumes pageheap_lock has been obtained.
  */
-superblock *search_free(int sclass, heap *aheap, int *bucketnum){
-	int i;
-	for (i = 0; i< FULLNESS_DENOM; i++) {
-		superblock *freeblk = aheap->buckets[i][sclass];
-		if (freeblk != NULL){
-			*bucketnum = i;
-			assert(freeblk->bucketnum == i);
-			return freeblk;
+span *alloc_span(size_t npages, int *zeroed) {
+	span *s;
+	for (s = PAGEHEAP_FREE; s != NULL; s = s->next) {
+		if (s->npages >= npages) {
+			return carve_span(s, npages, zeroed);
 		}
 	}
-	
-	return NULL;
+	// nothing fits so get more pages, merging them with a free span at the top
+	if (npages > PAGE_MAP_SIZE - PAGEHEAP_TOP) {
+		return NULL;
+	}
+	s = mem_sbrk(npages * PAGE_SIZE);
+	if (s == NULL) {
+		return NULL;
+	}
+	++PAGEHEAP_SBRK_CALLS;
+	assert(page_number(s) == PAGEHEAP_TOP);
+	PAGEHEAP_TOP += npages;
+	s->npages = npages;
+	s->free = 0;
+	// only the header we just wrote is resident
+	s = free_span(s, 0);
+	return carve_span(s, npages, zeroed);
 }
 
 /*
- * Removes superblock blk from the given bucket.
- * Assume heap lock is held.
+ * Cuts the allocated span s in two after its first npages, and returns
+ * the second part as a span of its own.
+ * Assumes pageheap_lock has been obtained.
  */
-void remove_sb_from_bucket(heap *myheap, int bucketnum, int sizeclass, superblock *blk) {
-	assert(bucketnum >= 0 && bucketnum < FULLNESS_DENOM);
-	superblock *oldnext = blk->next;
-	superblock *oldprev = blk->prev;
+span *split_span(span *s, size_t npages) {
+	assert(!s->free && s->npages > npages);
+	span *rest = (span *)(page_address(page_number(s) + npages));
+	rest->npages = s->npages - npages;
+	rest->free = 0;
+	s->npages = npages;
+	map_span(s, s);
+	map_span(rest, rest);
+	return rest;
+}
+
+/*
+ * Grows the allocated span s to npages in place, out of the free span
+ * right after it, or out of mem_sbrk if s is at the top of the page heap.
+ * Returns 0 if there isn't room.
+ * Assumes pageheap_lock has been obtained.
+ */
+int grow_span(span *s, size_t npages) {
+	assert(!s->free && s->npages < npages);
+	size_t first = page_number(s);
+	size_t end = first + s->npages;
+	span *after = end < PAGEHEAP_TOP ? PAGE_MAP[end] : NULL;
+	if (after != NULL && !after->free) {
+		after = NULL;
+	}
+	size_t avail = s->npages + (after != NULL ? after->npages : 0);
+	if (avail < npages) {
+		// only the span at the top can have more pages
+		if (first + avail != PAGEHEAP_TOP || npages - avail > PAGE_MAP_SIZE - PAGEHEAP_TOP) {
+			return 0;
+		}
+		void *more = mem_sbrk((npages - avail) * PAGE_SIZE);
+		if (more == NULL) {
+			return 0;
+		}
+		++PAGEHEAP_SBRK_CALLS;
+		PAGEHEAP_TOP += npages - avail;
+		avail = npages;
+	}
+	if (after != NULL) {
+		remove_free_span(after);
+		PAGEHEAP_DIRTY -= after->dirty;
+		if (avail > npages) {
+			// put back what we don't need
+			span *rest = (span *)(page_address(first + npages));
+			rest->npages = avail - npages;
+			rest->dirty = after->dirty < rest->npages - 1 ? after->dirty : rest->npages - 1;
+			PAGEHEAP_DIRTY += rest->dirty;
+			insert_free_span(rest);
+			map_span(rest, rest);
+		}
+	}
+	s->npages = npages;
+	map_span(s, s);
+	return 1;
+}
+
+/*
+ * Gives the memory of free spans back to the OS once too much of it has
+ * been resident for too long, highest addresses first since alloc_span
+ * reuses the lowest ones first. The page holding a span's header has to
+ * stay.
+ * Assumes pageheap_lock has been obtained.
+ */
+void release_free_pages() {
+	if (PAGEHEAP_DIRTY <= PAGEHEAP_DIRTY_HIGH) {
+		PAGEHEAP_DIRTY_SINCE = 0;
+		return;
+	}
+	unsigned long now = pageheap_clock();
+	if (PAGEHEAP_DIRTY_SINCE == 0) {
+		PAGEHEAP_DIRTY_SINCE = now;
+	}
+	if (now - PAGEHEAP_DIRTY_SINCE < PAGEHEAP_RELEASE_DELAY) {
+		return;
+	}
+	assert(PAGEHEAP_FREE_TAIL == NULL || PAGEHEAP_FREE_TAIL->next == NULL);
+	span *s;
+	for (s = PAGEHEAP_FREE_TAIL; s != NULL && PAGEHEAP_DIRTY > PAGEHEAP_DIRTY_LOW; s = s->prev) {
+		if (s->dirty > 0) {
+			mem_decommit(page_address(page_number(s) + 1), (s->npages - 1) * PAGE_SIZE);
+			PAGEHEAP_DIRTY -= s->dirty;
+			s->dirty = 0;
+		}
+	}
+	PAGEHEAP_DIRTY_SINCE = 0;
+}
+
+// run release_free_pages if it looks like there's something to do
+// this gets called from the heaps so memory still goes back while the
+// page heap itself is idle. The counts are only a hint without the
+// lock, which release_free_pages looks at again under it
+void maybe_release_free_pages() {
+	size_t dirty = __atomic_load_n(&PAGEHEAP_DIRTY, __ATOMIC_RELAXED);
+	unsigned long since = __atomic_load_n(&PAGEHEAP_DIRTY_SINCE, __ATOMIC_RELAXED);
+	if (dirty > PAGEHEAP_DIRTY_HIGH &&
+	    (since == 0 || pageheap_clock() - since >= PAGEHEAP_RELEASE_DELAY)) {
+		LOCK_PAGEHEAP();
+		release_free_pages();
+		UNLOCK_PAGEHEAP();
+	}
+}
+
+// get fresh pages for one or more superblocks, NULL if we're out of memory
+// every one of them maps to NULL, since a free may land on any of them
+char *alloc_chunk_pages(size_t npages) {
+	LOCK_PAGEHEAP();
+	span *s = alloc_span(npages, NULL);
+	if (s != NULL) {
+		size_t first = page_number(s);
+		size_t i;
+		for (i = 0; i < npages; ++i) {
+			PAGE_MAP[first + i] = NULL;
+		}
+	}
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+	return (char *)s;
+}
+
+// mark the npages at sb as one superblock for find_superblock
+void set_superblock_lead(char *sb, size_t npages) {
+	size_t first = page_number(sb);
+	size_t i;
+	for (i = 0; i < npages; ++i) {
+		SUPERBLOCK_LEAD[first + i] = i;
+	}
+}
+
+// get fresh pages for a superblock, NULL if we're out of memory
+char *alloc_superblock_pages(size_t npages) {
+	assert(npages >= 1 && npages <= SUPERBLOCK_MAX_PAGES);
+	char *sb = alloc_chunk_pages(npages);
+	if (sb != NULL) {
+		set_superblock_lead(sb, npages);
+	}
+	return sb;
+}
+
+// give the pages of an empty superblock back to the page heap
+void free_superblock_pages(char *sb, size_t npages) {
+	span *s = (span *)sb;
+	LOCK_PAGEHEAP();
+	s->npages = npages;
+	s->free = 0;
+	free_span(s, npages - 1);
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+}
+
+// how many bytes of pages a large object of the given size takes up
+size_t large_span_size(size_t size) {
+	return round_to(size + LARGE_HSIZE, PAGE_SIZE);
+}
+
+/*
+ * Allocates an object too big for any size class.
+ * If zero is set, the object is cleared, which only takes a memset of
+ * whatever pages may have been used before.
+ */
+void *large_malloc(size_t size, int zero) {
+	if (size > PAGE_MAP_SIZE * PAGE_SIZE) {
+		return NULL;
+	}
+	size_t npages = large_span_size(size) / PAGE_SIZE;
+	int zeroed;
+	LOCK_PAGEHEAP();
+	span *s = alloc_span(npages, &zeroed);
+	if (s != NULL) {
+		map_span(s, s);
+		++PAGEHEAP_LARGE_MALLOCS;
+	}
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+	if (s == NULL) {
+		return NULL;
+	}
+	char *ret = (char *)s + LARGE_HSIZE;
+	if (zero) {
+		// the first page may have been used before since it held a header
+		size_t dirty = PAGE_SIZE - LARGE_HSIZE;
+		memset(ret, 0, zeroed && size > dirty ? dirty : size);
+	}
+	return ret;
+}
+
+/*
+ * Allocates an object too big for any size class, or with a bigger
+ * alignment than any size class has, aligned to align.
+ * The span header is still at the start of the span, so if the object
+ * doesn't start in the first page, its page is mapped to the span too.
+ * Alignments bigger than a page take a bigger span, which gets trimmed.
+ */
+void *large_memalign(size_t align, size_t size) {
+	if (align <= LARGE_HSIZE) {
+		return large_malloc(size, 0);
+	}
+	if (size > PAGE_MAP_SIZE * PAGE_SIZE || align > PAGE_MAP_SIZE * PAGE_SIZE) {
+		return NULL;
+	}
+	// how far into the span the object starts, if the span is aligned
+	size_t offset = align < PAGE_SIZE ? align : PAGE_SIZE;
+	size_t npages = round_to(offset + size, PAGE_SIZE) / PAGE_SIZE;
+	size_t slack = align > PAGE_SIZE ? align / PAGE_SIZE - 1 : 0;
+	char *ret = NULL;
+	LOCK_PAGEHEAP();
+	span *s = alloc_span(npages + slack, NULL);
+	if (s != NULL) {
+		map_span(s, s);
+		ret = (char *)round_to((size_t)s + offset, align);
+		size_t lead = page_number(ret - offset) - page_number(s);
+		if (lead > 0) {
+			span *front = s;
+			s = split_span(front, lead);
+			free_span(front, front->npages - 1);
+		}
+		if (s->npages > npages) {
+			span *rest = split_span(s, npages);
+			free_span(rest, rest->npages - 1);
+		}
+		PAGE_MAP[page_number(ret)] = s;
+		++PAGEHEAP_LARGE_MALLOCS;
+	}
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+	return ret;
+}
+
+// how many bytes the large object at ptr in span s has room for
+size_t large_usable_size(span *s, void *ptr) {
+	return (char *)s + s->npages * PAGE_SIZE - (char *)ptr;
+}
+
+/*
+ * Resizes the large object at ptr in span s to size bytes in place,
+ * giving pages it no longer needs back, or growing into the pages after
+ * it if they're free. Returns 0 if it can't grow in place.
+ */
+int large_resize(span *s, void *ptr, size_t size) {
+	size_t offset = (char *)ptr - (char *)s;
+	if (size > PAGE_MAP_SIZE * PAGE_SIZE) {
+		return 0;
+	}
+	size_t npages = round_to(offset + size, PAGE_SIZE) / PAGE_SIZE;
+	int ok = 1;
+	LOCK_PAGEHEAP();
+	if (npages < s->npages) {
+		span *rest = split_span(s, npages);
+		free_span(rest, rest->npages - 1);
+	} else if (npages > s->npages) {
+		ok = grow_span(s, npages);
+	}
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+	return ok;
+}
+
+// free an object from large_malloc, given its span
+void large_free(span *s) {
+	LOCK_PAGEHEAP();
+	assert(!s->free);
+	++PAGEHEAP_LARGE_FREES;
+	free_span(s, s->npages - 1);
+	release_free_pages();
+	UNLOCK_PAGEHEAP();
+}
+
+void debug_pageheap() {
+	printf("-------------------------------------------------------\n");
+	printf("Page heap info:\n");
+	printf("Pages in use: %u of %u\n", (unsigned)PAGEHEAP_TOP, (unsigned)PAGE_MAP_SIZE);
+	printf("Free pages that may be resident: %u\n", (unsigned)PAGEHEAP_DIRTY);
+	span *s;
+	for (s = PAGEHEAP_FREE; s != NULL; s = s->next) {
+		printf("free span at page %u, %u pages, %u dirty\n", (unsigned)page_number(s), (unsigned)s->npages, (unsigned)s->dirty);
+	}
+}
+
+// ---------------------------------------------------------------------
+// Thread cache structure
+// ---------------------------------------------------------------------
+
+// only size classes up to this size get cached per thread
+#define TCACHE_MAX_SIZE 1024
+
+// a thread holds at most this many free blocks of one size class...
+#define TCACHE_MAX_BLOCKS 64
+
+// ...and at most about this many bytes of one size class
+#define TCACHE_MAX_BYTES 16384
+
+// a new thread starts out holding at most this many blocks of a size class
+// and doubles it whenever the bin runs empty or overflows, so short lived
+// threads and rarely used size classes don't hoard memory
+#define TCACHE_START_BLOCKS 4
+
+// a thread holds at most about this many bytes in all of its bins together
+#define TCACHE_THREAD_BYTES 65536
+
+// number of size classes that are cached, set during mm_init
+int TCACHE_NUM_CLASSES = 0;
+
+// how many blocks of each cached size class a thread may hold
+int *TCACHE_LIMITS = NULL;
+
+// size of the thread cache structure padded to cache line
+size_t TCACHE_SIZE = 0;
+
+// free blocks of one size class, linked through their first word
+struct tcache_bin_t {
+	void *head;
+	int count;
+	// how many blocks this bin may currently hold
+	int limit;
+};
+typedef struct tcache_bin_t tcache_bin;
+
+struct tcache_t {
+	// the block this cache was allocated from, since we align inside it
+	void *block;
+
+	// how many bytes are sitting in all the bins
+	size_t bytes;
+
+	// one bin per cached size class
+	tcache_bin *bins;
+};
+typedef struct tcache_t tcache;
+
+// this thread's cache, created on the first malloc or free
+__thread tcache *MY_TCACHE = NULL;
+
+// used to flush a thread's cache when it exits
+pthread_key_t tcache_key;
+
+void tcache_destroy(void *arg);
+
+// ---------------------------------------------------------------------
+// Per cpu cache structure
+// ---------------------------------------------------------------------
+
+// When restartable sequences are available, the cached size classes are
+// cached per cpu instead of per thread. Each cpu gets CPU_CACHE_STRIDE
+// bytes of CPU_CACHES: first a count for every cached size class, then
+// for each size class an array of TCACHE_LIMITS[i] slots holding free
+// blocks, starting CPU_CACHE_OFFSETS[i] words into it.
+// Only a thread running on that cpu touches it, and the kernel restarts
+// the thread's push or pop if it gets preempted or moved in the middle.
+
+// whether the per cpu caches are used rather than the thread caches
+int CPU_CACHE_ON = 0;
+
+char *CPU_CACHES = NULL;
+size_t CPU_CACHE_STRIDE = 0;
+long *CPU_CACHE_OFFSETS = NULL;
+
+#ifdef HAVE_RSEQ
+// the signature the kernel expects right before an abort handler
+#define RSEQ_SIGNATURE "0x53053053"
+
+// this thread's rseq area, which glibc keeps at a fixed offset from the thread pointer
+struct rseq *rseq_area() {
+	char *tp;
+	__asm__ ("movq %%fs:0, %0" : "=r" (tp));
+	return (struct rseq *)(tp + __rseq_offset);
+}
+#endif
+
+// ---------------------------------------------------------------------
+// Per thread counter structure
+// ---------------------------------------------------------------------
+
+/*
+ * mm_malloc and mm_free count calls per size class in a slot of the
+ * calling thread's own, so the fast paths don't share anything.
+ * Slots come from the page heap, so no two of them share a cache line.
+ * They're never freed: when a thread exits its slot is given up and the
+ * next new thread takes it over, counts and all, so mm_stats_class only
+ * has to add up every slot there is.
+ */
+struct thread_stats_t {
+	// nonzero while a thread is counting into this
+	int taken;
+	
+	// every slot there is, linked through here, newest first
+	struct thread_stats_t *next;
+	
+	// NUM_SIZE_CLASSES counters each, after this structure
+	unsigned long *mallocs;
+	unsigned long *frees;
+	
+#ifdef LATENCY_PROFILE
+	// after those, a latency histogram for every call, group of size
+	// classes (see LAT_GROUPS) and path
+	unsigned int *latency;
+#endif
+};
+typedef struct thread_stats_t thread_stats;
+
+#ifdef LATENCY_PROFILE
+// latency histograms have LAT_SUB buckets for every power of two of
+// cycles, each as wide as an LAT_SUB'th of it, up to 2^32 cycles
+#define LAT_SUB_BITS 3
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((32 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_MALLOC 0
+#define LAT_FREE 1
+
+// the histograms are by coarse groups of size classes rather than by
+// class, which keeps a slot's to under 50KB: the classes of up to each
+// of LAT_GROUP_LIMITS bytes, the bigger classes, and large objects
+#define LAT_GROUPS 5
+#define LAT_GROUP_LARGE (LAT_GROUPS - 1)
+const size_t LAT_GROUP_LIMITS[LAT_GROUPS - 2] = {64, 256, 1024};
+
+// where the histogram of a call, group and path starts in a slot
+#define LAT_HISTOGRAM(ts, call, group, path) \
+	((ts)->latency + (((call) * LAT_GROUPS + (group)) * LAT_PATHS + (path)) * LAT_BUCKETS)
+#define LAT_HISTOGRAMS (2 * LAT_GROUPS * LAT_PATHS * LAT_BUCKETS)
+
+// time one call in every LATENCY_SAMPLE of each thread, a power of two
+unsigned long LATENCY_SAMPLE = 16;
+
+// this thread's mm_malloc and mm_free calls so far, to pick which are
+// timed, counted apart so that alternating calls get both timed
+__thread unsigned long LATENCY_TICKS[2] = {0, 0};
+
+void latency_report();
+#endif
+
+// this thread's slot, taken on its first count
+__thread thread_stats *MY_STATS = NULL;
+
+// the newest slot, only ever pushed onto
+thread_stats *STATS_SLOTS = NULL;
+
+// used to give a thread's slot up when it exits
+pthread_key_t stats_key;
+
+// where mm_stats_dump goes when the process exits, NULL for nowhere
+const char *STATS_PATH = NULL;
+
+void stats_release(void *arg);
+void stats_atexit();
+
+// ---------------------------------------------------------------------
+// Helper functions for finding the right size class
+// ---------------------------------------------------------------------
+
+// find which size class s falls into
+int find_size_class(size_t s) {
+	if (s <= SIZE_LOOKUP_MAX) {
+		return SIZE_CLASS_LOOKUP[(s + 7) >> 3];
+	}
+	// otherwise find the power of two range it's in and search from there
+	int candidate = POW2_SIZE_CLASS[64 - __builtin_clzl(s - 1)];
+	while (candidate < NUM_SIZE_CLASSES && SIZE_CLASSES[candidate] < s) {
+		++candidate;
+	}
+	if (candidate >= NUM_SIZE_CLASSES) {
+		// too big of a request
+		return -1;
+	}
+	return candidate;
+}
+
+// ---------------------------------------------------------------------
+// Helper functions for mm_init
+// ---------------------------------------------------------------------
+
+// read a setting from the environment, or use the default
+unsigned long env_setting(const char *name, unsigned long dflt) {
+	const char *value = getenv(name);
+	if (value == NULL || *value == '\0') {
+		return dflt;
+	}
+	return strtoul(value, NULL, 10);
+}
+
+// initialize all the size classes
+int init_size_classes() {
+	// allocate enough to hold MAX_NUM_SIZE_CLASS many sizes
+	size_t request_size = round_to_cache(sizeof(size_t) * MAX_NUM_SIZE_CLASS);
+	SIZE_CLASSES = mem_sbrk(request_size);
+	if (SIZE_CLASSES == NULL) {
+		return -1;
+	}
+	
+	// calculate the size of each size class
+	size_t size = MIN_SIZE_CLASS;
+	NUM_SIZE_CLASSES = 0;
+	while (size <= MAX_SIZE_CLASS && NUM_SIZE_CLASSES < MAX_NUM_SIZE_CLASS) {
+		SIZE_CLASSES[NUM_SIZE_CLASSES] = size;
+		
+		++NUM_SIZE_CLASSES;
+		// step by a fraction of the power of two we're in, but at least a quantum
+		size_t step = ((size_t)1 << (63 - __builtin_clzl(size))) / SIZE_CLASS_STEPS;
+		size += step > SIZE_CLASS_QUANTUM ? step : SIZE_CLASS_QUANTUM;
+	}
+	
+	// build the lookup tables for find_size_class out of SIZE_CLASSES
+	assert(SIZE_CLASSES[NUM_SIZE_CLASSES-1] >= SIZE_LOOKUP_MAX);
+	size_t lookup_size = round_to_cache(SIZE_LOOKUP_MAX / 8 + 1);
+	size_t pow2_size = round_to_cache(65);
+	SIZE_CLASS_LOOKUP = mem_sbrk(lookup_size + pow2_size);
+	if (SIZE_CLASS_LOOKUP == NULL) {
+		return -1;
+	}
+	POW2_SIZE_CLASS = SIZE_CLASS_LOOKUP + lookup_size;
+	request_size += lookup_size + pow2_size;
+	int sizeclass = 0;
+	for (size = 0; size <= SIZE_LOOKUP_MAX; size += 8) {
+		while (SIZE_CLASSES[sizeclass] < size) {
+			++sizeclass;
+		}
+		SIZE_CLASS_LOOKUP[size >> 3] = sizeclass;
+	}
+	int bits;
+	sizeclass = 0;
+	for (bits = 1; bits <= 64; ++bits) {
+		size_t lower = (size_t)1 << (bits - 1);
+		while (sizeclass < NUM_SIZE_CLASSES && SIZE_CLASSES[sizeclass] <= lower) {
+			++sizeclass;
+		}
+		POW2_SIZE_CLASS[bits] = sizeclass;
+	}
+	/*
+	// debugging
+	long n;
+	for (n = 0; n < NUM_SIZE_CLASSES; ++n) {
+		printf("%ld: %u\n", n, SIZE_CLASSES[n]);
+	}
+	*/
+	return request_size;
+}
+
+// pick how many pages the superblocks of each size class get: enough
+// for CAMEL_SUPERBLOCK_BLOCKS blocks (SUPERBLOCK_TARGET_BLOCKS by default)
+// but at most CAMEL_SUPERBLOCK_MAX_KB, and never more blocks than
+// SUPERBLOCK_MAX_BLOCKS. CAMEL_SUPERBLOCK_BLOCKS=1 gives every class
+// single page superblocks. Also how many pages heaps carve them out of
+// assumes init_size_classes has been called
+int init_superblock_sizes() {
+	size_t request_size = round_to_cache(sizeof(size_t) * NUM_SIZE_CLASSES);
+	SUPERBLOCK_SIZES = mem_sbrk(request_size);
+	if (SUPERBLOCK_SIZES == NULL) {
+		return -1;
+	}
+	size_t target = env_setting("CAMEL_SUPERBLOCK_BLOCKS", SUPERBLOCK_TARGET_BLOCKS);
+	size_t max_pages = env_setting("CAMEL_SUPERBLOCK_MAX_KB", SUPERBLOCK_MAX_KB) * 1024 / PAGE_SIZE;
+	if (max_pages > SUPERBLOCK_MAX_PAGES) {
+		max_pages = SUPERBLOCK_MAX_PAGES;
+	}
+	SUPERBLOCK_CHUNK_PAGES = env_setting("CAMEL_CHUNK_KB", SUPERBLOCK_CHUNK_KB) * 1024 / PAGE_SIZE;
+	int i;
+	for (i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		size_t class_size = SIZE_CLASSES[i];
+		size_t npages = round_to(class_size * target, PAGE_SIZE) / PAGE_SIZE;
+		if (npages > max_pages) {
+			npages = max_pages;
+		}
+		while (npages > 1 && npages * PAGE_SIZE / class_size > SUPERBLOCK_MAX_BLOCKS) {
+			--npages;
+		}
+		if (npages < 1) {
+			npages = 1;
+		}
+		SUPERBLOCK_SIZES[i] = npages * PAGE_SIZE;
+	}
+	return request_size;
+}
+
+// work out the fullness bucket thresholds of each size class
+// assumes init_superblock_sizes has been called
+int init_fullness_thresholds() {
+	size_t request_size = round_to_cache(sizeof(size_t) * NUM_SIZE_CLASSES * FULLNESS_DENOM);
+	FULLNESS_THRESHOLDS = mem_sbrk(request_size);
+	if (FULLNESS_THRESHOLDS == NULL) {
+		return -1;
+	}
+	int i, j;
+	for (i = 0; i < NUM_SIZE_CLASSES; ++i) {
+		size_t capacity = SUPERBLOCK_SIZES[i];
+		for (j = 0; j < FULLNESS_DENOM; ++j) {
+			// bucket j holds superblocks that are at most (FULLNESS_DENOM-j)/FULLNESS_DENOM full
+			FULLNESS_THRESHOLDS[i*FULLNESS_DENOM + j] = capacity * (FULLNESS_DENOM - j) / FULLNESS_DENOM;
+		}
+	}
+	return request_size;
+}
+
+// work out which size classes get a thread cache and how big it may get
+int init_tcache() {
+	TCACHE_NUM_CLASSES = 0;
+	while (TCACHE_NUM_CLASSES < NUM_SIZE_CLASSES && SIZE_CLASSES[TCACHE_NUM_CLASSES] <= TCACHE_MAX_SIZE) {
+		++TCACHE_NUM_CLASSES;
+	}
+
+	size_t request_size = round_to_cache(sizeof(int) * TCACHE_NUM_CLASSES);
+	TCACHE_LIMITS = mem_sbrk(request_size);
+	if (TCACHE_LIMITS == NULL) {
+		return -1;
+	}
+	int i;
+	for (i = 0; i < TCACHE_NUM_CLASSES; ++i) {
+		int limit = TCACHE_MAX_BYTES / SIZE_CLASSES[i];
+		TCACHE_LIMITS[i] = limit < TCACHE_MAX_BLOCKS ? limit : TCACHE_MAX_BLOCKS;
+	}
+	TCACHE_SIZE = round_to_cache(sizeof(tcache) + TCACHE_NUM_CLASSES * sizeof(tcache_bin));
+	// the caches themselves come out of a size class
+	assert(find_size_class(TCACHE_SIZE + CACHELINE_SIZE) >= 0);
+
+	if (pthread_key_create(&tcache_key, tcache_destroy)) {
+		return -1;
+	}
+	return request_size;
+}
+
+// lay out the per cpu caches, if this thread has an rseq area registered
+// with the kernel, in which case every thread will
+// they can be turned off with CAMEL_RSEQ=0
+// assumes init_tcache has been called and NUM_PROCESSORS has been set
+int init_cpu_cache() {
+	CPU_CACHE_ON = 0;
+#ifdef HAVE_RSEQ
+	if (__rseq_size == 0 || rseq_area()->cpu_id >= (unsigned)NUM_PROCESSORS ||
+	    env_setting("CAMEL_RSEQ", 1) == 0) {
+		return 0;
+	}
+	size_t request_size = round_to_cache(sizeof(long) * TCACHE_NUM_CLASSES);
+	CPU_CACHE_OFFSETS = mem_sbrk(request_size);
+	if (CPU_CACHE_OFFSETS == NULL) {
+		return -1;
+	}
+	// the counts come first, then the slots
+	long words = TCACHE_NUM_CLASSES;
+	int i;
+	for (i = 0; i < TCACHE_NUM_CLASSES; ++i) {
+		CPU_CACHE_OFFSETS[i] = words;
+		words += TCACHE_LIMITS[i];
+	}
+	CPU_CACHE_STRIDE = round_to_cache(words * sizeof(void*));
+	CPU_CACHES = mem_sbrk(CPU_CACHE_STRIDE * NUM_PROCESSORS);
+	if (CPU_CACHES == NULL) {
+		return -1;
+	}
+	request_size += CPU_CACHE_STRIDE * NUM_PROCESSORS;
+	for (i = 0; i < NUM_PROCESSORS; ++i) {
+		long *counts = (long*)(CPU_CACHES + i * CPU_CACHE_STRIDE);
+		int j;
+		for (j = 0; j < TCACHE_NUM_CLASSES; ++j) {
+			counts[j] = 0;
+		}
+	}
+	CPU_CACHE_ON = 1;
+	return request_size;
+#else
+	return 0;
+#endif
+}
+
+// work out which NUMA node every cpu is on, or if CAMEL_NUMA_NODES is
+// set, pretend there are that many nodes and split the cpus evenly
+// between them, so the per node heaps can be tried on any machine
+// assumes NUM_PROCESSORS has been set
+int init_numa() {
+	size_t request_size = round_to_cache(sizeof(int) * NUM_PROCESSORS);
+	CPU_NODE = mem_sbrk(request_size);
+	if (CPU_NODE == NULL) {
+		return -1;
+	}
+	unsigned long simulated = env_setting("CAMEL_NUMA_NODES", 0);
+	if (simulated > 0) {
+		NUM_NODES = simulated < MAX_NUMA_NODES ? simulated : MAX_NUMA_NODES;
+		int i;
+		for (i = 0; i < NUM_PROCESSORS; ++i) {
+			CPU_NODE[i] = (long)i * NUM_NODES / NUM_PROCESSORS;
+		}
+	} else {
+		NUM_NODES = getCpuNodes(CPU_NODE, NUM_PROCESSORS, MAX_NUMA_NODES);
+	}
+	NUM_HEAPS = NUM_PROCESSORS + NUM_NODES;
+	return request_size;
+}
+
+// turn thread heaps on if CAMEL_THREAD_HEAPS=1, so every thread
+// allocates from a heap of its own, made the first time it needs it
+// assumes init_numa has been called
+int init_thread_heaps() {
+	THREAD_HEAPS_ON = env_setting("CAMEL_THREAD_HEAPS", 0) != 0;
+	FIRST_THREAD_HEAP = NUM_HEAPS;
+	pthread_mutex_init(&thread_heaps_lock, NULL);
+	if (pthread_key_create(&heap_key, heap_release)) {
+		return -1;
+	}
+	return 0;
+}
+
+// set up the page heap, with a PAGE_MAP big enough for the whole data segment,
+// and SUPERBLOCK_META and SUPERBLOCK_LEAD for as many pages
+// they're as big as the reservation, so they get their own mappings that
+// only take up memory for the parts that get used
+// the release policy can be changed with CAMEL_RELEASE_DELAY_MS,
+// CAMEL_DIRTY_HIGH_KB and CAMEL_DIRTY_LOW_KB
+int init_page_heap() {
+	pthread_mutex_init(&pageheap_lock, NULL);
+	PAGEHEAP_RELEASE_DELAY = env_setting("CAMEL_RELEASE_DELAY_MS", PAGEHEAP_RELEASE_DELAY_MS);
+	PAGEHEAP_DIRTY_HIGH = env_setting("CAMEL_DIRTY_HIGH_KB", PAGEHEAP_DIRTY_HIGH_KB) * 1024 / PAGE_SIZE;
+	PAGEHEAP_DIRTY_LOW = env_setting("CAMEL_DIRTY_LOW_KB", PAGEHEAP_DIRTY_LOW_KB) * 1024 / PAGE_SIZE;
+	if (PAGEHEAP_DIRTY_LOW > PAGEHEAP_DIRTY_HIGH) {
+		PAGEHEAP_DIRTY_LOW = PAGEHEAP_DIRTY_HIGH;
+	}
+	PAGEHEAP_DIRTY = 0;
+	PAGEHEAP_DIRTY_SINCE = 0;
+	PAGE_MAP_SIZE = dseg_size / PAGE_SIZE;
+	size_t request_size = round_to(sizeof(span*) * PAGE_MAP_SIZE, mem_pagesize());
+	PAGE_MAP = mmap(NULL, request_size, PROT_READ | PROT_WRITE,
+	                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (PAGE_MAP == MAP_FAILED) {
+		PAGE_MAP = NULL;
+		return -1;
+	}
+	// the superblock descriptors and page offsets go the same way
+	request_size = round_to(sizeof(superblock) * PAGE_MAP_SIZE, mem_pagesize());
+	SUPERBLOCK_META = mmap(NULL, request_size, PROT_READ | PROT_WRITE,
+	                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (SUPERBLOCK_META == MAP_FAILED) {
+		SUPERBLOCK_META = NULL;
+		return -1;
+	}
+	request_size = round_to(PAGE_MAP_SIZE, mem_pagesize());
+	SUPERBLOCK_LEAD = mmap(NULL, request_size, PROT_READ | PROT_WRITE,
+	                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (SUPERBLOCK_LEAD == MAP_FAILED) {
+		SUPERBLOCK_LEAD = NULL;
+		return -1;
+	}
+	PAGEHEAP_TOP = 0;
+	PAGEHEAP_FREE = NULL;
+	PAGEHEAP_FREE_TAIL = NULL;
+	return 0;
+}
+
+// set up the per thread counters, and a dump of the statistics at exit
+// to the file named by CAMEL_STATS, if it's set
+int init_stats() {
+	STATS_SLOTS = NULL;
+	if (pthread_key_create(&stats_key, stats_release)) {
+		return -1;
+	}
+	const char *path = getenv("CAMEL_STATS");
+	if (path != NULL && *path != '\0') {
+		STATS_PATH = path;
+		atexit(stats_atexit);
+	}
+	return 0;
+}
+
+// ---------------------------------------------------------------------
+// mm_init
+// ---------------------------------------------------------------------
+
+int mm_init (void) {
+	if (mem_init()) {
+		return -1;
+	}
+	
+	// back the heap with huge pages if CAMEL_HUGEPAGES asks for them
+	// (1 for transparent huge pages, 2 for hugetlbfs)
+	mem_huge_pages(env_setting("CAMEL_HUGEPAGES", MEM_HUGE_NONE));
+	
+	int size_classes_size = init_size_classes();
+	if (size_classes_size < 0) {
+		return -1;
+	}
+	int superblock_sizes_size = init_superblock_sizes();
+	if (superblock_sizes_size < 0) {
+		return -1;
+	}
+	int tcache_limits_size = init_tcache();
+	if (tcache_limits_size < 0) {
+		return -1;
+	}
+	int thresholds_size = init_fullness_thresholds();
+	if (thresholds_size < 0) {
+		return -1;
+	}
+	
+	// calculate how big the the fullness buckets and counters need to be;
+	size_t num_free_buckets = (FULLNESS_DENOM) * NUM_SIZE_CLASSES;
+	HEAP_SIZE = round_to_cache(sizeof(heap) + num_free_buckets * sizeof(superblock*) + NUM_SIZE_CLASSES * sizeof(heap_counters));
+	
+	// calculate number of processors
+	NUM_PROCESSORS = getNumProcessors();
+	
+	int cpu_cache_size = init_cpu_cache();
+	if (cpu_cache_size < 0) {
+		return -1;
+	}
+	
+	int numa_size = init_numa();
+	if (numa_size < 0) {
+		return -1;
+	}
+	
+	if (init_thread_heaps() < 0) {
+		return -1;
+	}
+	
+	// make the shared array of heaps
+	// heap 0 is node 0's global heap, then come the per cpu heaps,
+	// then the global heaps of the other nodes, and then room for the
+	// thread heaps if they're on
+	size_t heaps_array_size = round_to_cache((NUM_HEAPS + (THREAD_HEAPS_ON ? MAX_THREAD_HEAPS : 0))*sizeof(heap*));
+	HEAPS = mem_sbrk(heaps_array_size);
+	assert(HEAPS != NULL);
+	
+	// initialize all heaps
+	int i;
+	for (i = 0; i < NUM_PROCESSORS; ++i) {
+		HEAPS[i+1] = new_heap(CPU_NODE[i], 0);
+		assert(HEAPS[i+1] != 0);
+	}
+	size_t stacks_size = round_to_cache(NUM_SIZE_CLASSES*sizeof(gstack));
+	for (i = 0; i < NUM_NODES; ++i) {
+		heap *global = new_heap(i, 1);
+		assert(global != 0);
+		global->stacks = mem_sbrk(stacks_size);
+		assert(global->stacks != NULL);
+		memset(global->stacks, 0, stacks_size);
+		HEAPS[global_heap(i)] = global;
+	}
+	
+	//void test_heap();
+	//test_heap();
+	
+	//void test_superblock();
+	//test_superblock();
+	
+	if (init_page_heap() < 0) {
+		return -1;
+	}
+	
+	if (init_stats() < 0) {
+		return -1;
+	}
+	
+#ifdef LOCK_PROFILE
+	atexit(lock_profile_report);
+#endif
+#ifdef LATENCY_PROFILE
+	// down to a power of two, so picking calls is a mask
+	unsigned long sample = env_setting("CAMEL_LATENCY_SAMPLE", 16);
+	LATENCY_SAMPLE = 1;
+	while (LATENCY_SAMPLE * 2 <= sample) {
+		LATENCY_SAMPLE *= 2;
+	}
+	atexit(latency_report);
+#endif
+	
+	int total_overhead = size_classes_size + superblock_sizes_size + thresholds_size + tcache_limits_size + cpu_cache_size + numa_size + heaps_array_size + HEAP_SIZE*NUM_HEAPS + stacks_size*NUM_NODES;
+	
+DEBUG("Page size: %db\n", mem_pagesize());
+DEBUG("Overhead: %db\n", total_overhead);
+	
+	// pad out the rest so the superblocks will start page aligned
+	size_t padding = total_overhead % mem_pagesize();
+	if (padding > 0) {
+		padding = mem_pagesize() - padding;
+		mem_sbrk(padding);
+	}
+	SUPERBLOCK_START = total_overhead + padding + dseg_lo;
+	// the page heap gets whatever is left
+	PAGE_MAP_SIZE = (dseg_lo + dseg_size - SUPERBLOCK_START) / PAGE_SIZE;
+	// every block has to fit in a gfree link, and every superblock in a gstack link
+	assert((unsigned long)dseg_size / 8 < GFREE_LINK_MASK && PAGE_MAP_SIZE < 0xffffffffUL);
+	
+DEBUG("Superblock start: %db\n", SUPERBLOCK_START - dseg_lo);
+	
+	return 0;
+}
+
+/*
+ * Helper function for allocating free blocks.
+ * It assumes the given superblock is not completely full.
+ * It takes up to n free blocks from the superblock into out, a whole
+ * run of the freelist (or word of the bitmap) at a time, and returns
+ * how many it took, stopping early only if the superblock fills up.
+ * Assumes the heap that owns freeblk is locked.
+ */
+int allocate_blocks(int sclass, superblock *freeblk, void **out, int n) {
+	size_t class_size = SIZE_CLASSES[sclass];
+	int got = 0;
+#ifdef SUPERBLOCK_BITMAP
+	// take the lowest free blocks
+	assert(freeblk->nfree > 0);
+	char *data = superblock_data(freeblk);
+	int i = 0;
+	while (got < n && freeblk->nfree > 0) {
+		while (freeblk->freemap[i] == 0) {
+			++i;
+		}
+		unsigned long word = freeblk->freemap[i];
+		while (got < n && word != 0) {
+			out[got++] = data + (i * 64 + __builtin_ctzl(word)) * class_size;
+			word &= word - 1;
+			--freeblk->nfree;
+		}
+		freeblk->freemap[i] = word;
+	}
+#else
+	assert(freeblk->head != NULL);
+	while (got < n && freeblk->head != NULL) {
+		freelist *freespace = freeblk->head;
+		// take blocks off the end of the run, the run itself last
+		while (got < n && freespace->n > 1) {
+			--freespace->n;
+			out[got++] = (char *)freespace + freespace->n * class_size;
+		}
+		if (got == n) {
+			break;
+		}
+		assert(freespace->n == 1);
+		out[got++] = freespace;
+		if (freespace->next != FREELIST_END) {
+			freeblk->head = (freelist *)(superblock_data(freeblk) + freespace->next);
+		} else {
+			freeblk->head = NULL;
+		}
+	}
+#endif
+	freeblk->allocated += got * class_size;
+	return got;
+}
+
+/*
+ * Search function for finding available superblock.
+ * Searches fullness buckets for free block of sizeclass sclass.
+ * Returns pointer to said superblock.
+ * Assumes lock on heap aheap has been acquired.
+ */
+superblock *search_free(int sclass, heap *aheap, int *bucketnum){
+	int i;
+	for (i = 0; i< FULLNESS_DENOM; i++) {
+		superblock *freeblk = aheap->buckets[i][sclass];
+		if (freeblk != NULL){
+			*bucketnum = i;
+			assert(freeblk->bucketnum == i);
+			return freeblk;
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * Removes superblock blk from the given bucket.
+ * Assume heap lock is held.
+ */
+void remove_sb_from_bucket(heap *myheap, int bucketnum, int sizeclass, superblock *blk) {
+	assert(bucketnum >= 0 && bucketnum < FULLNESS_DENOM);
+	superblock *oldnext = blk->next;
+	superblock *oldprev = blk->prev;
 	if (oldprev == NULL) { //blk is the head of the bucket
 		assert(myheap->buckets[bucketnum][sizeclass] == blk);
 		myheap->buckets[bucketnum][sizeclass] = oldnext;
 	} else {
-		// otherwise update it to point past blk and to the next one
-		oldprev->next = oldnext;
+		// otherwise update it to point past blk and to the next one
+		oldprev->next = oldnext;
+	}
+	if (oldnext != NULL) {
+		oldnext->prev = oldprev;
+	}
+	blk->next = NULL;
+	blk->prev = NULL;
+	blk->bucketnum = -1;
+	// update superblock count
+	--myheap->num_superblocks;
+}
+
+/*
+ * Inserts the given superblock into the head of this bucket.
+ * Assume heap lock is held.
+ */
+void insert_sb_into_bucket(heap *myheap, int bucketnum, int sizeclass, superblock *freeblk) {
+	superblock *newnext = myheap->buckets[bucketnum][sizeclass];
+	myheap->buckets[bucketnum][sizeclass] = freeblk;
+	freeblk->next = newnext;
+	freeblk->prev = NULL;
+	if (newnext != NULL) {
+		// update the new next superblock's prev
+		newnext->prev = freeblk;
+	}
+	freeblk->bucketnum = bucketnum;
+	// update superblock count
+	++myheap->num_superblocks;
+}
+
+/*
+ * Works out which fullness bucket the given superblock belongs in,
+ * from 0 for the most full to FULLNESS_DENOM-1 for the least full.
+ */
+int fullness_bucket(superblock *blk) {
+	size_t *thresholds = &FULLNESS_THRESHOLDS[blk->size_class * FULLNESS_DENOM];
+	int bucketnum = FULLNESS_DENOM - 1;
+	while (bucketnum > 0 && blk->allocated > thresholds[bucketnum]) {
+		--bucketnum;
+	}
+	return bucketnum;
+}
+
+/*
+ * Given that we've just allocated blocks from the first superblock
+ * in bucket bucketnum from size class sizeclass, we need to potentially
+ * move this superblock to another bucket or remove it completely if it
+ * is completely full.
+ * 
+ * Assume the given heap is locked.
+ */
+void update_buckets(heap *myheap, int bucketnum, int sizeclass) {
+	superblock *freeblk = myheap->buckets[bucketnum][sizeclass];
+	assert(freeblk != NULL);
+	if (superblock_full(freeblk)) {
+		// if the block freelist is empty, then it means this superblock is full
+		// so just remove it from the buckets
+		remove_sb_from_bucket(myheap, bucketnum, sizeclass, freeblk);
+	} else {
+		// otherwise the block freelist isn't empty
+		// now we have to check whether it got fuller and needs to be moved to another fullness bucket
+		int newbucket = fullness_bucket(freeblk);
+		if (newbucket != bucketnum) {
+			remove_sb_from_bucket(myheap, bucketnum, sizeclass, freeblk);
+			insert_sb_into_bucket(myheap, newbucket, sizeclass, freeblk);
+		}
+	}
+}
+
+void drain_remote(int owner);
+
+void update_freelist(superblock *blk, void *ptr);
+
+// the link to a superblock on a gstack or in a gnext, and back
+unsigned int gstack_link(superblock *sb) {
+	return sb != NULL ? (unsigned int)(sb - SUPERBLOCK_META) + 1 : 0;
+}
+
+superblock *gstack_superblock(unsigned long link) {
+	link &= 0xffffffffUL;
+	return link != 0 ? &SUPERBLOCK_META[link - 1] : NULL;
+}
+
+// the tagged top of a gstack that has sb on top, one change after old
+unsigned long gstack_top(unsigned long old, superblock *sb) {
+	return ((old >> 32) + 1) << 32 | gstack_link(sb);
+}
+
+// push superblocks first to last, which are linked through their gnext,
+// onto st as one
+void gstack_push(gstack *st, superblock *first, superblock *last, long n) {
+	unsigned long old = __atomic_load_n(&st->top, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&last->gnext, (unsigned int)old, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(&st->top, &old, gstack_top(old, first), 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	__atomic_fetch_add(&st->depth, n, __ATOMIC_RELAXED);
+}
+
+// pop the top superblock off st, or return NULL if it's empty
+// the top's gnext may be read after someone else has popped it, which
+// is why descriptors are never unmapped, and why the tag is there
+superblock *gstack_pop(gstack *st) {
+	unsigned long old = __atomic_load_n(&st->top, __ATOMIC_ACQUIRE);
+	superblock *sb;
+	do {
+		sb = gstack_superblock(old);
+		if (sb == NULL) {
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(&st->top, &old,
+	                                      gstack_top(old, gstack_superblock(__atomic_load_n(&sb->gnext, __ATOMIC_RELAXED))),
+	                                      1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	__atomic_fetch_sub(&st->depth, 1, __ATOMIC_RELAXED);
+	return sb;
+}
+
+// take everything off st at once, linked through their gnext
+superblock *gstack_pop_all(gstack *st) {
+	unsigned long old = __atomic_load_n(&st->top, __ATOMIC_ACQUIRE);
+	while (gstack_superblock(old) != NULL &&
+	       !__atomic_compare_exchange_n(&st->top, &old, gstack_top(old, NULL), 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	return gstack_superblock(old);
+}
+
+// the first block on a gfree list, and a gfree list with ptr in front
+void *gfree_first(unsigned long gfree) {
+	gfree &= GFREE_LINK_MASK;
+	return gfree != 0 ? SUPERBLOCK_START + (gfree - 1) * 8 : NULL;
+}
+
+unsigned long gfree_add(unsigned long gfree, void *ptr, int n) {
+	return ((gfree >> GFREE_LINK_BITS) + n) << GFREE_LINK_BITS | (((char*)ptr - SUPERBLOCK_START) / 8 + 1);
+}
+
+/*
+ * Gives the superblocks of size class sizeclass in global heap global
+ * that have become empty back to the page heap. Nothing can be taken
+ * out of the middle of a stack, so the whole stack is taken off and the
+ * rest put back; heaps that come looking meanwhile make new superblocks.
+ * The global heap's lock keeps trims from overlapping, and keeps them
+ * from happening during a fork.
+ */
+void trim_global(heap *global, int sizeclass) {
+	gstack *st = &global->stacks[sizeclass];
+	size_t class_size = SIZE_CLASSES[sizeclass];
+	LATENCY_PATH(LAT_GLOBAL);
+	LOCK_HEAP(global);
+	superblock *sb = gstack_pop_all(st);
+	superblock *keep = NULL;
+	superblock *last = NULL;
+	long taken = 0;
+	long kept = 0;
+	while (sb != NULL) {
+		superblock *next = gstack_superblock(sb->gnext);
+		++taken;
+		unsigned long gfree = __atomic_load_n(&sb->gfree, __ATOMIC_ACQUIRE);
+		// closing it keeps anyone from freeing into it afterwards,
+		// though with nothing allocated nobody should
+		if ((gfree >> GFREE_LINK_BITS) * class_size == sb->allocated &&
+		    __atomic_compare_exchange_n(&sb->gfree, &gfree, GFREE_CLOSED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			global->counters[sizeclass].frees += gfree >> GFREE_LINK_BITS;
+			++global->counters[sizeclass].released;
+			free_superblock_pages(superblock_data(sb), SUPERBLOCK_SIZES[sizeclass] / PAGE_SIZE);
+		} else {
+			__atomic_store_n(&sb->gnext, gstack_link(keep), __ATOMIC_RELAXED);
+			keep = sb;
+			if (last == NULL) {
+				last = sb;
+			}
+			++kept;
+		}
+		sb = next;
+	}
+	__atomic_fetch_sub(&st->depth, taken, __ATOMIC_RELAXED);
+	if (keep != NULL) {
+		gstack_push(st, keep, last, kept);
+	}
+	UNLOCK_HEAP(global);
+}
+
+/*
+ * Frees the n blocks in ptrs into superblock thisblk, which global heap
+ * global owned as of a moment ago, by pushing them onto its gfree with a
+ * single compare and swap. Whoever frees the last allocated block trims
+ * the global heap.
+ * Returns 0 if a heap has taken the superblock out of the global heap
+ * since, in which case they have to go to that heap instead.
+ */
+int global_free(heap *global, superblock *thisblk, void **ptrs, int n) {
+	LATENCY_PATH(LAT_REMOTE);
+	int i;
+	for (i = 0; i < n - 1; ++i) {
+		*(void**)ptrs[i] = ptrs[i+1];
+	}
+	unsigned long old = __atomic_load_n(&thisblk->gfree, __ATOMIC_ACQUIRE);
+	unsigned long new;
+	do {
+		if (old == GFREE_CLOSED) {
+			return 0;
+		}
+		*(void**)ptrs[n-1] = gfree_first(old);
+		new = gfree_add(old, ptrs[0], n);
+	} while (!__atomic_compare_exchange_n(&thisblk->gfree, &old, new, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	// allocated doesn't change while it's in a global heap, and if a
+	// heap has taken it since, the trim finds nothing to do
+	int sizeclass = thisblk->size_class;
+	if ((new >> GFREE_LINK_BITS) * SIZE_CLASSES[sizeclass] == thisblk->allocated) {
+		trim_global(global, sizeclass);
+	}
+	return 1;
+}
+
+/*
+ * Moves a superblock of size class sizeclass, if there is one, from the
+ * global heap global over to heap mine, with the blocks freed into it
+ * while it was there put back, and returns it with the bucket it's in now.
+ * Assumes heap mine is locked.
+ */
+superblock *take_from_global(int mine, heap *global, int sizeclass, int *bucketnum) {
+	heap *myheap = HEAPS[mine];
+	superblock *freeblk = gstack_pop(&global->stacks[sizeclass]);
+	if (freeblk == NULL) {
+		return NULL;
+	}
+	LATENCY_PATH(LAT_GLOBAL);
+	// change owners first, so a free that finds it closed goes to mine
+	__atomic_store_n(&freeblk->owner, mine, __ATOMIC_RELAXED);
+	unsigned long gfree = __atomic_exchange_n(&freeblk->gfree, GFREE_CLOSED, __ATOMIC_ACQ_REL);
+	assert(gfree != GFREE_CLOSED);
+	long n = gfree >> GFREE_LINK_BITS;
+	void *ptr = gfree_first(gfree);
+	long i;
+	for (i = 0; i < n; ++i) {
+		void *next = *(void**)ptr;
+		update_freelist(freeblk, ptr);
+		ptr = next;
+	}
+	freeblk->allocated -= n * SIZE_CLASSES[sizeclass];
+	myheap->counters[sizeclass].frees += n;
+	myheap->counters[sizeclass].remote_frees += n;
+	assert(!superblock_full(freeblk));
+	*bucketnum = fullness_bucket(freeblk);
+	insert_sb_into_bucket(myheap, *bucketnum, sizeclass, freeblk);
+	return freeblk;
+}
+
+/*
+ * Gives this thread a heap of its own, one that an exited thread left
+ * behind if there is one, or a new one from the page heap otherwise,
+ * and returns its number.
+ * Returns -1 if every thread heap is taken or we're out of memory, in
+ * which case the thread goes on using its cpu's heap.
+ */
+int heap_take() {
+	int node = CPU_NODE[sched_getcpu()];
+	int n = __atomic_load_n(&NUM_HEAPS, __ATOMIC_ACQUIRE);
+	int i;
+	for (i = FIRST_THREAD_HEAP; i < n; ++i) {
+		heap *h = HEAPS[i];
+		if (__atomic_load_n(&h->retired, __ATOMIC_RELAXED) == 0) {
+			continue;
+		}
+		LOCK_HEAP(h);
+		int taken = h->retired;
+		if (taken) {
+			// it may have been left behind on another node
+			__atomic_store_n(&h->retired, 0, __ATOMIC_RELAXED);
+			h->node = node;
+		}
+		UNLOCK_HEAP(h);
+		if (taken) {
+			break;
+		}
+	}
+	if (i == n) {
+		pthread_mutex_lock(&thread_heaps_lock);
+		i = NUM_HEAPS;
+		heap *h = NULL;
+		if (i < FIRST_THREAD_HEAP + MAX_THREAD_HEAPS) {
+			h = (heap*)large_malloc(HEAP_SIZE, 0);
+		}
+		if (h == NULL) {
+			pthread_mutex_unlock(&thread_heaps_lock);
+			MY_HEAP = -1;
+			return -1;
+		}
+		init_heap(h, node, 0);
+		h->thread = 1;
+		HEAPS[i] = h;
+		// anyone who sees the new count sees the heap too
+		__atomic_store_n(&NUM_HEAPS, i + 1, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&thread_heaps_lock);
+	}
+	MY_HEAP = i;
+	// register it so it gets retired when this thread exits
+	pthread_setspecific(heap_key, HEAPS[i]);
+	return i;
+}
+
+// the number of the heap the calling thread allocates from and frees to
+int my_heap() {
+	if (THREAD_HEAPS_ON) {
+		int mine = MY_HEAP;
+		if (__builtin_expect(mine == 0, 0)) {
+			mine = heap_take();
+		}
+		if (mine > 0) {
+			return mine;
+		}
+	}
+	int mycpu = sched_getcpu();
+	assert(mycpu >= 0 && mycpu < NUM_PROCESSORS);
+	return mycpu + 1;
+}
+
+// give what's left of h's chunk back to the page heap
+// assumes h's lock has been obtained
+void return_chunk(heap *h) {
+	if (h->chunk_pages > 0) {
+		free_superblock_pages(h->chunk, h->chunk_pages);
+	}
+	h->chunk = NULL;
+	h->chunk_pages = 0;
+}
+
+/*
+ * Gets fresh pages for a superblock of h, off the front of its chunk, so
+ * only every SUPERBLOCK_CHUNK_PAGES pages take the page heap's lock.
+ * When what's left of the chunk is too small it goes back and a new one
+ * is taken; if there's no memory for that, just the superblock is.
+ * Returns NULL if we're out of memory.
+ * Assumes h's lock has been obtained.
+ */
+char *heap_superblock_pages(heap *h, size_t npages) {
+	LATENCY_PATH(LAT_PAGES);
+	if (h->chunk_pages < npages) {
+		if (SUPERBLOCK_CHUNK_PAGES <= npages) {
+			return alloc_superblock_pages(npages);
+		}
+		return_chunk(h);
+		h->chunk = alloc_chunk_pages(SUPERBLOCK_CHUNK_PAGES);
+		if (h->chunk == NULL) {
+			return alloc_superblock_pages(npages);
+		}
+		h->chunk_pages = SUPERBLOCK_CHUNK_PAGES;
+	}
+	char *sb = h->chunk;
+	h->chunk += npages * PAGE_SIZE;
+	h->chunk_pages -= npages;
+	set_superblock_lead(sb, npages);
+	return sb;
+}
+
+/*
+ * Allocates up to n blocks of size class sizeclass into out, from as
+ * many superblocks of the current cpu's (or thread's) heap as it takes, or else from
+ * a single superblock of its node's global heap, or a new superblock
+ * from the page heap, in that order. Only if the page heap is out of
+ * memory does it take a superblock from another node's global heap.
+ * Blocks other cpus have freed back to this heap are put back first.
+ * Returns how many blocks were allocated, which is 0 only if we're out
+ * of memory.
+ */
+int heap_malloc(int sizeclass, void **out, int n) {
+	maybe_release_free_pages();
+	int mine = my_heap();
+DEBUG("heap_malloc: heap %d, size class %d, n %d\n", mine, sizeclass, n);
+	// check this heap for free block
+	heap *myheap = HEAPS[mine];
+	int bucketnum;
+	int got = 0;
+	// lock this heap
+	LOCK_HEAP(myheap);
+	if (__atomic_load_n(&myheap->remote, __ATOMIC_RELAXED) != NULL) {
+		drain_remote(mine);
+	}
+	superblock *freeblk;
+	while (got < n && (freeblk = search_free(sizeclass, myheap, &bucketnum)) != NULL) {
+		got += allocate_blocks(sizeclass, freeblk, &out[got], n - got);
+		//potentially move the superblock around to another fullness bucket
+		update_buckets(myheap, bucketnum, sizeclass);
+	}
+	if (got > 0) {
+		myheap->counters[sizeclass].mallocs += got;
+		UNLOCK_HEAP(myheap);
+		return got;
+	}
+DEBUG("heap_malloc: Checking global heap\n");
+	// unsuccessful in myheap, so check our node's global heap
+	int node = myheap->node;
+	freeblk = take_from_global(mine, HEAPS[global_heap(node)], sizeclass, &bucketnum);
+	if (freeblk != NULL) {
+		// now we continue as if we found a suitable superblock in our own heap
+		got = allocate_blocks(sizeclass, freeblk, out, n);
+		++myheap->counters[sizeclass].from_global;
+		myheap->counters[sizeclass].mallocs += got;
+		//potentially move the superblock around to another fullness bucket
+		update_buckets(myheap, bucketnum, sizeclass);
+		UNLOCK_HEAP(myheap);
+		assert(got > 0);
+		return got;
+	}
+DEBUG("heap_malloc: getting a new superblock\n");
+	// unsucessful in global heap too, so get new superblock
+	char *page = heap_superblock_pages(myheap, SUPERBLOCK_SIZES[sizeclass] / PAGE_SIZE);
+	if (page != NULL) {
+		// make sure we're not out of memory, otherwise just return NULL
+		superblock *newblk = init_superblock(mine, sizeclass, page);
+		got = allocate_blocks(sizeclass, newblk, out, n);
+		++myheap->counters[sizeclass].new_superblocks;
+		myheap->counters[sizeclass].mallocs += got;
+		if (!superblock_full(newblk)) {
+			// only add to buckets if this isn't full
+			insert_sb_into_bucket(myheap, FULLNESS_DENOM-1, sizeclass, newblk);
+			update_buckets(myheap, FULLNESS_DENOM - 1, sizeclass);
+		} else {
+			newblk->bucketnum = -1;
+		}
+		assert(got > 0);
+		UNLOCK_HEAP(myheap);
+		return got;
+	}
+	// out of memory, so as a last resort take a superblock from another node
+	int other;
+	for (other = 0; other < NUM_NODES; ++other) {
+		if (other == node) {
+			continue;
+		}
+		freeblk = take_from_global(mine, HEAPS[global_heap(other)], sizeclass, &bucketnum);
+		if (freeblk != NULL) {
+			got = allocate_blocks(sizeclass, freeblk, out, n);
+			++myheap->counters[sizeclass].from_global;
+			++myheap->counters[sizeclass].from_other_node;
+			myheap->counters[sizeclass].mallocs += got;
+			update_buckets(myheap, bucketnum, sizeclass);
+			break;
+		}
+	}
+	UNLOCK_HEAP(myheap);
+	return got;
+}
+
+// report a free of something that isn't an allocated block, and stop
+// before it corrupts anything
+void bad_free(void *ptr) {
+	fprintf(stderr, "camel: free of %p, which isn't an allocated block\n", ptr);
+	abort();
+}
+
+/*
+ * Function that indicates that there is a new free space in
+ * superblock blk by updating its freelist. 
+ * Assumes the heap that owns blk is locked.
+ */
+void update_freelist(superblock *blk, void *ptr) {
+#ifdef SUPERBLOCK_BITMAP
+	unsigned int offset = (unsigned int)((char *)ptr - superblock_data(blk));
+	unsigned int class_size = SIZE_CLASSES[blk->size_class];
+	unsigned int index = offset / class_size;
+	unsigned long bit = 1UL << (index % 64);
+	if (index * class_size != offset || (blk->freemap[index / 64] & bit) != 0) {
+		bad_free(ptr);
+	}
+	blk->freemap[index / 64] |= bit;
+	++blk->nfree;
+#else
+	freelist *currfree = blk->head;
+	blk->head = (freelist *)ptr;
+	//check what old head was and update stats accordingly
+	if (currfree == NULL) {
+		blk->head->next = FREELIST_END;
+	} else {
+		unsigned int curroff = (unsigned int)((char *)currfree - superblock_data(blk));
+		assert(curroff < SUPERBLOCK_SIZES[blk->size_class]);
+		blk->head->next = curroff;
+	}
+	blk->head->n = 1;
+	assert(blk->head != NULL);
+#endif
+}
+
+// find the superblock that the given block is in
+superblock *find_superblock(void *ptr) {
+	size_t page = page_number(ptr);
+	return &SUPERBLOCK_META[page - SUPERBLOCK_LEAD[page]];
+}
+
+/*
+ * Takes superblock thisblk, which is in bucket bucketnum, out of
+ * thisheap and gives it to the global heap of thisheap's node, or back
+ * to the page heap if it's empty.
+ * Assumes thisheap owns thisblk and is locked.
+ */
+void give_to_global(heap *thisheap, int bucketnum, superblock *thisblk) {
+	heap_counters *counters = &thisheap->counters[thisblk->size_class];
+	// nothing can find it once it's out of our buckets
+	remove_sb_from_bucket(thisheap, bucketnum, thisblk->size_class, thisblk);
+	LATENCY_PATH(LAT_GLOBAL);
+	if (thisblk->allocated == 0) {
+DEBUG("heap_free: releasing\n");
+		++counters->released;
+		free_superblock_pages(superblock_data(thisblk), SUPERBLOCK_SIZES[thisblk->size_class] / PAGE_SIZE);
+		return;
+	}
+DEBUG("heap_free: moving to global heap\n");
+	++counters->to_global;
+	// it goes to the global heap of our own node
+	int g = global_heap(thisheap->node);
+	heap *global = HEAPS[g];
+	// open it to frees, then change the owner of this block, so a free
+	// that sees the new owner sees it open too
+	__atomic_store_n(&thisblk->gfree, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&thisblk->owner, g, __ATOMIC_RELEASE);
+	gstack_push(&global->stacks[thisblk->size_class], thisblk, thisblk, 1);
+}
+
+/*
+ * Frees the n blocks in ptrs, which all belong to superblock thisblk,
+ * then moves the superblock to the right fullness bucket of its heap,
+ * over to the global heap if it has become empty enough (or whenever
+ * its heap is a retired thread heap), or back to the page heap if it
+ * has become empty.
+ * Assumes thisheap owns thisblk and is locked.
+ *
+ * Blocks still on their way back through a remote list count as
+ * allocated, so a superblock that looks empty here really is, and it's
+ * safe to give it away.
+ */
+void free_blocks(heap *thisheap, superblock *thisblk, void **ptrs, int n) {
+	int i;
+	for (i = 0; i < n; ++i) {
+		update_freelist(thisblk, ptrs[i]);
+	}
+	thisblk->allocated -= n * SIZE_CLASSES[thisblk->size_class];
+	heap_counters *counters = &thisheap->counters[thisblk->size_class];
+	counters->frees += n;
+	
+	int bucketnum = thisblk->bucketnum;
+	assert(bucketnum >= -1 && bucketnum < FULLNESS_DENOM);
+	// frees into a global heap's superblocks go through global_free
+	assert(!thisheap->global);
+	
+	//check if this block should be moved to another fullness bucket
+	//but only if it's not completely full, since then it stays out of the buckets
+	if (!superblock_full(thisblk)) {
+		int newbucket = fullness_bucket(thisblk);
+		if (bucketnum == -1) {
+			// need to put it into a bucket if it's not completely full anymore
+			insert_sb_into_bucket(thisheap, newbucket, thisblk->size_class, thisblk);
+		} else if (newbucket != bucketnum) {
+DEBUG("heap_free: moving buckets\n");
+			remove_sb_from_bucket(thisheap, bucketnum, thisblk->size_class, thisblk);
+			insert_sb_into_bucket(thisheap, newbucket, thisblk->size_class, thisblk);
+		}
+	}
+	
+	//check if stuff can be moved to global heap, or given back if it's empty
+	//a retired heap has nobody left to allocate from it, so it gives up everything
+	if (thisheap->retired ||
+	    (thisheap->num_superblocks > SB_RESERVE && thisblk->allocated < ALLOC_THRESHOLD(thisblk->size_class))) {
+		assert(!superblock_full(thisblk)); // shouldn't be full
+		bucketnum = thisblk->bucketnum;
+		assert(bucketnum >= 0 && bucketnum < FULLNESS_DENOM);
+		give_to_global(thisheap, bucketnum, thisblk);
+	}
+}
+
+/*
+ * Hands the n blocks in ptrs over to heap h for later, with a single
+ * compare and swap no matter how many blocks there are.
+ */
+void push_remote(heap *h, void **ptrs, int n) {
+	LATENCY_PATH(LAT_REMOTE);
+	int i;
+	for (i = 0; i < n - 1; ++i) {
+		*(void**)ptrs[i] = ptrs[i+1];
+	}
+	void *head = __atomic_load_n(&h->remote, __ATOMIC_RELAXED);
+	do {
+		*(void**)ptrs[n-1] = head;
+	} while (!__atomic_compare_exchange_n(&h->remote, &head, ptrs[0], 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Frees the n blocks in ptrs, which all belong to superblock thisblk,
+ * on behalf of heap mine.
+ * If the superblock belongs to mine, that heap is locked and the blocks
+ * are freed right away. If it belongs to a global heap they go onto its
+ * gfree, and otherwise they're pushed onto the remote list of the heap
+ * that owns it, both without taking a lock.
+ * A retired thread heap has nobody to take its remote list, so it gets
+ * locked too if it's free, and hands the superblock over to its global
+ * heap (another heap's lock may be held here, and thread heaps are
+ * never waited for with one held).
+ * Assumes the heap mine isn't locked unless it doesn't own thisblk.
+ */
+void free_from(int mine, superblock *thisblk, void **ptrs, int n) {
+	for (;;) {
+		int owner = __atomic_load_n(&thisblk->owner, __ATOMIC_ACQUIRE);
+		assert(owner >= 0 && owner < __atomic_load_n(&NUM_HEAPS, __ATOMIC_RELAXED));
+		heap *thisheap = HEAPS[owner];
+		if (is_global_heap(owner)) {
+			if (global_free(thisheap, thisblk, ptrs, n)) {
+				return;
+			}
+			// a heap took it out of the global heap meanwhile
+			continue;
+		}
+		if (owner != mine) {
+			if (__atomic_load_n(&thisheap->retired, __ATOMIC_RELAXED) && TRYLOCK_HEAP(thisheap)) {
+				if (thisblk->owner == owner) {
+					free_blocks(thisheap, thisblk, ptrs, n);
+					// and whatever reached it since it retired
+					if (thisheap->retired && __atomic_load_n(&thisheap->remote, __ATOMIC_RELAXED) != NULL) {
+						drain_remote(owner);
+					}
+					UNLOCK_HEAP(thisheap);
+					return;
+				}
+				UNLOCK_HEAP(thisheap);
+				continue;
+			}
+			// if the superblock changes hands before the owner gets to
+			// these, it will pass them on
+			push_remote(thisheap, ptrs, n);
+			return;
+		}
+		LOCK_HEAP(thisheap);
+		// the owner can't change away from this heap while it's locked
+		if (thisblk->owner == owner) {
+			free_blocks(thisheap, thisblk, ptrs, n);
+			UNLOCK_HEAP(thisheap);
+			return;
+		}
+		// otherwise some other thread intervened so try again
+		UNLOCK_HEAP(thisheap);
+	}
+}
+
+/*
+ * Puts the blocks other cpus have freed back to heap owner into their
+ * superblocks, one run of blocks from the same superblock at a time.
+ * Blocks of superblocks that have changed hands since they were pushed
+ * are passed on.
+ * Assumes heap owner is locked.
+ */
+void drain_remote(int owner) {
+	heap *thisheap = HEAPS[owner];
+	void *ptr = __atomic_exchange_n(&thisheap->remote, NULL, __ATOMIC_ACQUIRE);
+	void *run[TCACHE_MAX_BLOCKS];
+	int runlen = 0;
+	superblock *runblk = NULL;
+	while (ptr != NULL) {
+		void *next = *(void**)ptr;
+		superblock *thisblk = find_superblock(ptr);
+		if ((thisblk != runblk || runlen == TCACHE_MAX_BLOCKS) && runlen > 0) {
+			if (runblk->owner == owner) {
+				thisheap->counters[runblk->size_class].remote_frees += runlen;
+				free_blocks(thisheap, runblk, run, runlen);
+			} else {
+				free_from(owner, runblk, run, runlen);
+			}
+			runlen = 0;
+		}
+		runblk = thisblk;
+		run[runlen++] = ptr;
+		ptr = next;
+	}
+	if (runlen > 0) {
+		if (runblk->owner == owner) {
+			thisheap->counters[runblk->size_class].remote_frees += runlen;
+			free_blocks(thisheap, runblk, run, runlen);
+		} else {
+			free_from(owner, runblk, run, runlen);
+		}
+	}
+}
+
+/*
+ * Frees the n blocks in ptrs, which all belong to superblock thisblk.
+ * Blocks of superblocks owned by another cpu's heap go onto its remote
+ * list, so a free never waits on another cpu's heap lock.
+ */
+void heap_free(superblock *thisblk, void **ptrs, int n) {
+DEBUG("heap_free: start\n");
+	maybe_release_free_pages();
+	free_from(my_heap(), thisblk, ptrs, n);
+DEBUG("heap_free: exit\n");
+}
+
+/*
+ * Retires this thread's heap as the thread exits: every superblock in
+ * its buckets goes to its node's global heap (or the page heap, if it's
+ * empty) and the heap is left for the next new thread to take.
+ * Superblocks that are completely full aren't in any bucket, so they
+ * follow once something in them gets freed (see free_from).
+ * Anything this thread frees after this goes through its cpu's heap.
+ */
+void heap_release(void *arg) {
+	heap *h = (heap*)arg;
+	int mine = MY_HEAP;
+	assert(mine >= FIRST_THREAD_HEAP && HEAPS[mine] == h);
+	MY_HEAP = -1;
+	LOCK_HEAP(h);
+	if (__atomic_load_n(&h->remote, __ATOMIC_RELAXED) != NULL) {
+		drain_remote(mine);
+	}
+	int i, j;
+	for (i = 0; i < FULLNESS_DENOM; ++i) {
+		for (j = 0; j < NUM_SIZE_CLASSES; ++j) {
+			while (h->buckets[i][j] != NULL) {
+				give_to_global(h, i, h->buckets[i][j]);
+			}
+		}
+	}
+	return_chunk(h);
+	__atomic_store_n(&h->retired, 1, __ATOMIC_RELAXED);
+	UNLOCK_HEAP(h);
+}
+
+/*
+ * Frees the n blocks in ptrs, which may come from any superblocks,
+ * handing runs of blocks from the same superblock over to heap_free
+ * together so its locks are taken once per run.
+ */
+void heap_free_blocks(void **ptrs, int n) {
+	int start = 0;
+	int i;
+	for (i = 1; i <= n; ++i) {
+		if (i == n || find_superblock(ptrs[i]) != find_superblock(ptrs[start])) {
+			heap_free(find_superblock(ptrs[start]), &ptrs[start], i - start);
+			start = i;
+		}
+	}
+}
+
+// ---------------------------------------------------------------------
+// Thread cache
+// ---------------------------------------------------------------------
+
+/*
+ * Creates this thread's cache out of a regular block, aligned within it
+ * to a cache line so that no other thread's data shares its lines.
+ * Returns NULL if we're out of memory.
+ */
+tcache *tcache_create() {
+	void *block;
+	if (heap_malloc(find_size_class(TCACHE_SIZE + CACHELINE_SIZE), &block, 1) == 0) {
+		return NULL;
+	}
+	tcache *tc = (tcache*)round_to((size_t)block, CACHELINE_SIZE);
+	tc->block = block;
+	tc->bytes = 0;
+	tc->bins = (tcache_bin*)((char*)tc + sizeof(tcache));
+	int i;
+	for (i = 0; i < TCACHE_NUM_CLASSES; ++i) {
+		tc->bins[i].head = NULL;
+		tc->bins[i].count = 0;
+		tc->bins[i].limit = TCACHE_START_BLOCKS < TCACHE_LIMITS[i] ? TCACHE_START_BLOCKS : TCACHE_LIMITS[i];
+	}
+	// register it so it gets flushed when this thread exits
+	pthread_setspecific(tcache_key, tc);
+	MY_TCACHE = tc;
+	return tc;
+}
+
+/*
+ * Takes n blocks off the bin for size class sizeclass and frees them back
+ * to their superblocks.
+ */
+void tcache_flush(tcache *tc, int sizeclass, int n) {
+	tcache_bin *bin = &tc->bins[sizeclass];
+	void *blocks[TCACHE_MAX_BLOCKS + 1];
+	assert(n <= bin->count && n <= TCACHE_MAX_BLOCKS + 1);
+	tc->bytes -= n * SIZE_CLASSES[sizeclass];
+	bin->count -= n;
+	int i;
+	for (i = 0; i < n; ++i) {
+		blocks[i] = bin->head;
+		bin->head = *(void**)bin->head;
+	}
+	heap_free_blocks(blocks, n);
+}
+
+// let a bin that keeps running empty or overflowing hold more blocks
+void tcache_grow(tcache_bin *bin, int sizeclass) {
+	bin->limit *= 2;
+	if (bin->limit > TCACHE_LIMITS[sizeclass]) {
+		bin->limit = TCACHE_LIMITS[sizeclass];
+	}
+}
+
+/*
+ * Refills the bin for size class sizeclass with a batch of blocks from
+ * the heap, and returns one more block for the caller.
+ * Returns NULL if we're out of memory.
+ */
+void *tcache_refill(tcache *tc, int sizeclass) {
+	tcache_bin *bin = &tc->bins[sizeclass];
+	void *blocks[TCACHE_MAX_BLOCKS];
+	int got = heap_malloc(sizeclass, blocks, bin->limit / 2 + 1);
+	if (got == 0) {
+		return NULL;
+	}
+	tc->bytes += (got - 1) * SIZE_CLASSES[sizeclass];
+	while (--got > 0) {
+		*(void**)blocks[got] = bin->head;
+		bin->head = blocks[got];
+		++bin->count;
+	}
+	tcache_grow(bin, sizeclass);
+	return blocks[0];
+}
+
+// halve every bin of a thread that has too much memory sitting in its cache
+void tcache_shrink(tcache *tc) {
+	int i;
+	for (i = 0; i < TCACHE_NUM_CLASSES; ++i) {
+		tcache_flush(tc, i, (tc->bins[i].count + 1) / 2);
+	}
+}
+
+// flush everything left in a thread's cache when the thread exits
+void tcache_destroy(void *arg) {
+	tcache *tc = (tcache*)arg;
+	int i;
+	for (i = 0; i < TCACHE_NUM_CLASSES; ++i) {
+		tcache_flush(tc, i, tc->bins[i].count);
+	}
+	MY_TCACHE = NULL;
+	// the cache may start right at the start of its block, where a free
+	// links the block in, so the pointer to it has to live elsewhere
+	void *block = tc->block;
+	heap_free(find_superblock(block), &block, 1);
+}
+
+// ---------------------------------------------------------------------
+// Per cpu cache
+// ---------------------------------------------------------------------
+
+#ifdef HAVE_RSEQ
+/*
+ * Pops a free block of size class sizeclass off the current cpu's cache.
+ * Returns NULL if it's empty.
+ * Everything from label 1 to label 2 is a restartable sequence: if the
+ * thread is preempted, moved to another cpu or interrupted by a signal
+ * in there, the kernel sends it to the abort handler at label 4, which
+ * starts over on whatever cpu it's on now. Storing the new count is the
+ * last instruction, so the pop either happens completely or not at all.
+ */
+void *cpu_cache_pop(int sizeclass) {
+	void *ret;
+	__asm__ __volatile__ (
+		// the descriptor the kernel goes by: version, flags, start,
+		// length and abort handler
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n"
+		"5:\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs](%[rs])\n"
+		"1:\n\t"
+		"xorl %k[ret], %k[ret]\n\t"
+		// find this cpu's cache
+		"movl %c[cpu](%[rs]), %%eax\n\t"
+		"cmpl %[ncpu], %%eax\n\t"
+		"jae 2f\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		// take the top block if there is one
+		"movq (%%rax, %[cls], 8), %%rcx\n\t"
+		"testq %%rcx, %%rcx\n\t"
+		"jz 2f\n\t"
+		"leaq -1(%[off], %%rcx), %%rdx\n\t"
+		"movq (%%rax, %%rdx, 8), %[ret]\n\t"
+		"decq %%rcx\n\t"
+		"movq %%rcx, (%%rax, %[cls], 8)\n"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " RSEQ_SIGNATURE "\n"
+		"4:\n\t"
+		"jmp 5b\n\t"
+		".popsection\n"
+		: [ret] "=&r" (ret)
+		: [rs] "r" (rseq_area()),
+		  [ncpu] "rm" (NUM_PROCESSORS),
+		  [stride] "rm" (CPU_CACHE_STRIDE),
+		  [base] "r" (CPU_CACHES),
+		  [cls] "r" ((long)sizeclass),
+		  [off] "r" (CPU_CACHE_OFFSETS[sizeclass]),
+		  [cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu] "i" (offsetof(struct rseq, cpu_id))
+		: "rax", "rcx", "rdx", "cc", "memory");
+	return ret;
+}
+
+/*
+ * Pushes the free block ptr of size class sizeclass onto the current
+ * cpu's cache, as a restartable sequence like cpu_cache_pop.
+ * Returns 0 if the cache for sizeclass is full.
+ */
+int cpu_cache_push(int sizeclass, void *ptr) {
+	int ok;
+	__asm__ __volatile__ (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n"
+		"3:\n\t"
+		".long 0, 0\n\t"
+		".quad 1f, 2f - 1f, 4f\n\t"
+		".popsection\n\t"
+		"xorl %k[ok], %k[ok]\n"
+		"5:\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs](%[rs])\n"
+		"1:\n\t"
+		// find this cpu's cache
+		"movl %c[cpu](%[rs]), %%eax\n\t"
+		"cmpl %[ncpu], %%eax\n\t"
+		"jae 6f\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[base], %%rax\n\t"
+		// put the block on top if there's room
+		"movq (%%rax, %[cls], 8), %%rcx\n\t"
+		"cmpq %[cap], %%rcx\n\t"
+		"jae 6f\n\t"
+		"leaq (%[off], %%rcx), %%rdx\n\t"
+		"movq %[ptr], (%%rax, %%rdx, 8)\n\t"
+		"incq %%rcx\n\t"
+		"movq %%rcx, (%%rax, %[cls], 8)\n"
+		"2:\n\t"
+		"movl $1, %k[ok]\n"
+		"6:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long " RSEQ_SIGNATURE "\n"
+		"4:\n\t"
+		"jmp 5b\n\t"
+		".popsection\n"
+		: [ok] "=&r" (ok)
+		: [rs] "r" (rseq_area()),
+		  [ncpu] "rm" (NUM_PROCESSORS),
+		  [stride] "rm" (CPU_CACHE_STRIDE),
+		  [base] "r" (CPU_CACHES),
+		  [cls] "r" ((long)sizeclass),
+		  [off] "r" (CPU_CACHE_OFFSETS[sizeclass]),
+		  [cap] "rm" ((long)TCACHE_LIMITS[sizeclass]),
+		  [ptr] "r" (ptr),
+		  [cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu] "i" (offsetof(struct rseq, cpu_id))
+		: "rax", "rcx", "rdx", "cc", "memory");
+	return ok;
+}
+#else
+// never called, since CPU_CACHE_ON stays 0 without rseq
+void *cpu_cache_pop(int sizeclass) {
+	return NULL;
+}
+
+int cpu_cache_push(int sizeclass, void *ptr) {
+	return 0;
+}
+#endif
+
+/*
+ * Refills the current cpu's cache for size class sizeclass with a batch
+ * of blocks from the heap, and returns one more block for the caller.
+ * If the cache fills up first, because another thread on this cpu got
+ * there first or we've been moved, the rest go straight back.
+ * Returns NULL if we're out of memory.
+ */
+void *cpu_cache_refill(int sizeclass) {
+	void *blocks[TCACHE_MAX_BLOCKS];
+	int got = heap_malloc(sizeclass, blocks, TCACHE_LIMITS[sizeclass] / 2 + 1);
+	if (got == 0) {
+		return NULL;
+	}
+	int i;
+	for (i = 1; i < got; ++i) {
+		if (!cpu_cache_push(sizeclass, blocks[i])) {
+			heap_free_blocks(&blocks[i], got - i);
+			break;
+		}
+	}
+	return blocks[0];
+}
+
+/*
+ * Frees ptr, which didn't fit in the current cpu's full cache for size
+ * class sizeclass, along with half of the blocks in that cache so the
+ * heaps can reuse them.
+ */
+void cpu_cache_flush(int sizeclass, void *ptr) {
+	void *blocks[TCACHE_MAX_BLOCKS];
+	int n = 0;
+	blocks[n++] = ptr;
+	while (n <= TCACHE_LIMITS[sizeclass] / 2 && (blocks[n] = cpu_cache_pop(sizeclass)) != NULL) {
+		++n;
+	}
+	heap_free_blocks(blocks, n);
+}
+
+// ---------------------------------------------------------------------
+// Per thread counters
+// ---------------------------------------------------------------------
+
+// give up this thread's slot, as it exits
+// it takes a new one if it gets counted again after this
+void stats_release(void *arg) {
+	thread_stats *ts = (thread_stats*)arg;
+	MY_STATS = NULL;
+	__atomic_store_n(&ts->taken, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Gives this thread a slot, one that another thread gave up if there is
+ * one, or a new one otherwise.
+ * Returns NULL if we're out of memory.
+ */
+thread_stats *stats_take() {
+	thread_stats *ts;
+	for (ts = __atomic_load_n(&STATS_SLOTS, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next) {
+		int expected = 0;
+		if (__atomic_load_n(&ts->taken, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(&ts->taken, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (ts == NULL) {
+		size_t header = round_to(sizeof(thread_stats), sizeof(unsigned long));
+		size_t size = header + 2 * NUM_SIZE_CLASSES * sizeof(unsigned long);
+#ifdef LATENCY_PROFILE
+		size += LAT_HISTOGRAMS * sizeof(unsigned int);
+#endif
+		ts = (thread_stats*)large_malloc(size, 1);
+		if (ts == NULL) {
+			return NULL;
+		}
+		ts->taken = 1;
+		ts->mallocs = (unsigned long*)((char*)ts + header);
+		ts->frees = ts->mallocs + NUM_SIZE_CLASSES;
+#ifdef LATENCY_PROFILE
+		ts->latency = (unsigned int*)(ts->frees + NUM_SIZE_CLASSES);
+#endif
+		ts->next = __atomic_load_n(&STATS_SLOTS, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&STATS_SLOTS, &ts->next, ts, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	pthread_setspecific(stats_key, ts);
+	MY_STATS = ts;
+	return ts;
+}
+
+void count_malloc(int sizeclass, int n) {
+	thread_stats *ts = MY_STATS;
+	if (__builtin_expect(ts == NULL, 0) && (ts = stats_take()) == NULL) {
+		return;
+	}
+	ts->mallocs[sizeclass] += n;
+}
+
+void count_free(int sizeclass, int n) {
+	thread_stats *ts = MY_STATS;
+	if (__builtin_expect(ts == NULL, 0) && (ts = stats_take()) == NULL) {
+		return;
+	}
+	ts->frees[sizeclass] += n;
+}
+
+// ---------------------------------------------------------------------
+// mm_malloc, mm_free
+// ---------------------------------------------------------------------
+
+// free ptr, a block of size class sizeclass
+void class_free(void *ptr, int sizeclass) {
+	count_free(sizeclass, 1);
+	if (sizeclass < TCACHE_NUM_CLASSES) {
+		if (CPU_CACHE_ON) {
+			if (!cpu_cache_push(sizeclass, ptr)) {
+				cpu_cache_flush(sizeclass, ptr);
+			}
+			return;
+		}
+		tcache *tc = MY_TCACHE;
+		if (tc == NULL && (tc = tcache_create()) == NULL) {
+			// no cache to put it in, so free it directly
+			heap_free(find_superblock(ptr), &ptr, 1);
+			return;
+		}
+		tcache_bin *bin = &tc->bins[sizeclass];
+		*(void**)ptr = bin->head;
+		bin->head = ptr;
+		tc->bytes += SIZE_CLASSES[sizeclass];
+		if (++bin->count > bin->limit) {
+			// give half of it back so the heaps can reuse it
+			tcache_flush(tc, sizeclass, bin->count / 2);
+			tcache_grow(bin, sizeclass);
+		} else if (tc->bytes > TCACHE_THREAD_BYTES) {
+			tcache_shrink(tc);
+		}
+		return;
+	}
+	heap_free(find_superblock(ptr), &ptr, 1);
+}
+
+// allocate a block of size class sizeclass
+void *class_malloc(int sizeclass) {
+	count_malloc(sizeclass, 1);
+	if (sizeclass < TCACHE_NUM_CLASSES) {
+		if (CPU_CACHE_ON) {
+			void *ret = cpu_cache_pop(sizeclass);
+			return ret != NULL ? ret : cpu_cache_refill(sizeclass);
+		}
+		tcache *tc = MY_TCACHE;
+		if (tc == NULL && (tc = tcache_create()) == NULL) {
+			return NULL;
+		}
+		tcache_bin *bin = &tc->bins[sizeclass];
+		void *ret = bin->head;
+		if (ret == NULL) {
+			return tcache_refill(tc, sizeclass);
+		}
+		bin->head = *(void**)ret;
+		--bin->count;
+		tc->bytes -= SIZE_CLASSES[sizeclass];
+		return ret;
+	}
+	// too big to cache so go straight to the heap
+	void *ret = NULL;
+	heap_malloc(sizeclass, &ret, 1);
+	return ret;
+}
+
+#ifdef LATENCY_PROFILE
+// the histogram bucket that counts calls of the given cycles
+int latency_bucket(u_int64_t cycles) {
+	if (cycles < LAT_SUB) {
+		return cycles;
+	}
+	int k = 63 - __builtin_clzll(cycles);
+	int b = (k - LAT_SUB_BITS + 1) * LAT_SUB + ((cycles >> (k - LAT_SUB_BITS)) & (LAT_SUB - 1));
+	return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// the fewest cycles bucket b counts, or where the last one ends for
+// b = LAT_BUCKETS
+u_int64_t latency_bucket_low(int b) {
+	if (b < LAT_SUB) {
+		return b;
+	}
+	int k = b / LAT_SUB + LAT_SUB_BITS - 1;
+	return (u_int64_t)(LAT_SUB + b % LAT_SUB) << (k - LAT_SUB_BITS);
+}
+
+// the group of size class sizeclass, or of large objects for -1
+int latency_group(int sizeclass) {
+	if (sizeclass < 0) {
+		return LAT_GROUP_LARGE;
+	}
+	int g = 0;
+	while (g < LAT_GROUPS - 2 && SIZE_CLASSES[sizeclass] > LAT_GROUP_LIMITS[g]) {
+		++g;
+	}
+	return g;
+}
+
+// the biggest size class in group, or 0 for large objects
+size_t latency_group_max(int group) {
+	if (group == LAT_GROUP_LARGE) {
+		return 0;
+	}
+	return group < LAT_GROUPS - 2 ? LAT_GROUP_LIMITS[group] : SIZE_CLASSES[NUM_SIZE_CLASSES-1];
+}
+
+// count a call to size class sizeclass (-1 if large) that took cycles
+// in this thread's histograms, with the path it was marked with
+void record_latency(int call, int sizeclass, u_int64_t cycles) {
+	thread_stats *ts = MY_STATS;
+	if (ts != NULL || (ts = stats_take()) != NULL) {
+		++LAT_HISTOGRAM(ts, call, latency_group(sizeclass), LATENCY_PATH_TAKEN)[latency_bucket(cycles)];
+	}
+}
+
+// mm_malloc of a block that's timed, size not being 0
+void *timed_malloc(size_t size) {
+	LATENCY_PATH_TAKEN = LAT_CACHE;
+	u_int64_t start = read_counter();
+	void *ret;
+	int sizeclass = find_size_class(size);
+	if (sizeclass < 0) {
+		ret = large_malloc(size, 0);
+	} else {
+		ret = class_malloc(sizeclass);
+	}
+	u_int64_t cycles = read_counter() - start;
+	record_latency(LAT_MALLOC, sizeclass, cycles);
+	return ret;
+}
+
+// mm_free of a block that's timed, ptr not being NULL
+void timed_free(void *ptr) {
+	LATENCY_PATH_TAKEN = LAT_CACHE;
+	u_int64_t start = read_counter();
+	int sizeclass;
+	span *s = find_span(ptr);
+	if (s != NULL) {
+		large_free(s);
+		sizeclass = -1;
+	} else {
+		sizeclass = find_superblock(ptr)->size_class;
+		class_free(ptr, sizeclass);
+	}
+	u_int64_t cycles = read_counter() - start;
+	record_latency(LAT_FREE, sizeclass, cycles);
+}
+#endif
+
+void *mm_malloc (size_t size) {
+	if (size == 0) {
+		return NULL;
+	}
+#ifdef LATENCY_PROFILE
+	if (__builtin_expect((++LATENCY_TICKS[LAT_MALLOC] & (LATENCY_SAMPLE - 1)) == 0, 0)) {
+		return timed_malloc(size);
+	}
+#endif
+	int sizeclass = find_size_class(size);
+	if (sizeclass < 0) {
+		// too big for any size class
+		return large_malloc(size, 0);
+	}
+DEBUG("mm_malloc: size %u, size class %d\n", size, sizeclass);
+	return class_malloc(sizeclass);
+}
+
+void mm_free (void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+#ifdef LATENCY_PROFILE
+	if (__builtin_expect((++LATENCY_TICKS[LAT_FREE] & (LATENCY_SAMPLE - 1)) == 0, 0)) {
+		timed_free(ptr);
+		return;
+	}
+#endif
+	// large objects are the only pointers that map to a span
+	span *s = find_span(ptr);
+	if (s != NULL) {
+		large_free(s);
+		return;
+	}
+	//find superblock that this pointer is in
+	// the size class can't change while ptr is allocated so no lock is needed
+	class_free(ptr, find_superblock(ptr)->size_class);
+}
+
+/*
+ * Frees ptr, given the size it was asked for with mm_malloc or
+ * mm_calloc, or its mm_usable_size (or 0 if that isn't known, which
+ * makes it plain mm_free). The size class comes from size, so
+ * a block that goes into the cache has nothing read but the cache and
+ * the block itself. Only when it is too big for any size class do we
+ * look it up in the page map.
+ * A wrong size files the block under the wrong class (or under none);
+ * only debug builds check size against the block's superblock.
+ */
+void mm_free_sized (void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return;
+	}
+	if (size == 0) {
+		// we weren't told after all
+		mm_free(ptr);
+		return;
+	}
+	int sizeclass = find_size_class(size);
+	if (sizeclass < 0) {
+		span *s = find_span(ptr);
+		assert(s != NULL);
+		large_free(s);
+		return;
+	}
+	assert(find_span(ptr) == NULL);
+	assert(find_superblock(ptr)->size_class == sizeclass);
+	class_free(ptr, sizeclass);
+}
+
+// ---------------------------------------------------------------------
+// mm_malloc_batch, mm_free_batch
+// ---------------------------------------------------------------------
+
+// how many pointers mm_free_batch sorts and frees at a time
+#define FREE_BATCH 64
+
+/*
+ * Takes up to n blocks of the cached size class sizeclass out of this
+ * thread's (or cpu's) cache into out, and returns how many it took.
+ */
+int cache_pop_batch(int sizeclass, void **out, int n) {
+	int got = 0;
+	if (CPU_CACHE_ON) {
+		while (got < n && (out[got] = cpu_cache_pop(sizeclass)) != NULL) {
+			++got;
+		}
+		return got;
 	}
-	if (oldnext != NULL) {
-		oldnext->prev = oldprev;
+	tcache *tc = MY_TCACHE;
+	if (tc == NULL) {
+		return 0;
 	}
-	blk->next = NULL;
-	blk->prev = NULL;
-	blk->bucketnum = -1;
-	// update superblock count
-	--myheap->num_superblocks;
+	tcache_bin *bin = &tc->bins[sizeclass];
+	while (got < n && bin->head != NULL) {
+		out[got++] = bin->head;
+		bin->head = *(void**)bin->head;
+	}
+	bin->count -= got;
+	tc->bytes -= got * SIZE_CLASSES[sizeclass];
+	return got;
 }
 
 /*
- * Inserts the given superblock into the head of this bucket.
- * Assume heap lock is held.
+ * Allocates n blocks of size bytes into out. Whatever this thread has
+ * cached goes first, then the rest come straight from the heap, a
+ * superblock's worth per lock.
+ * Returns how many were allocated, which is less than n only if we're
+ * out of memory.
  */
-void insert_sb_into_bucket(heap *myheap, int bucketnum, int sizeclass, superblock *freeblk) {
-	superblock *newnext = myheap->buckets[bucketnum][sizeclass];
-	myheap->buckets[bucketnum][sizeclass] = freeblk;
-	freeblk->next = newnext;
-	freeblk->prev = NULL;
-	if (newnext != NULL) {
-		// update the new next superblock's prev
-		newnext->prev = freeblk;
+int mm_malloc_batch (size_t size, int n, void **out) {
+	if (size == 0 || n <= 0) {
+		return 0;
 	}
-	freeblk->bucketnum = bucketnum;
-	// update superblock count
-	++myheap->num_superblocks;
+	int got = 0;
+	int sizeclass = find_size_class(size);
+	if (sizeclass < 0) {
+		// too big for any size class
+		while (got < n && (out[got] = large_malloc(size, 0)) != NULL) {
+			++got;
+		}
+		return got;
+	}
+	if (sizeclass < TCACHE_NUM_CLASSES) {
+		got = cache_pop_batch(sizeclass, out, n);
+	}
+	while (got < n) {
+		int more = heap_malloc(sizeclass, &out[got], n - got);
+		if (more == 0) {
+			break;
+		}
+		got += more;
+	}
+	count_malloc(sizeclass, got);
+	return got;
 }
 
 /*
- * Given that we've just allocated a block from the first superblock
- * in bucket bucketnum from size class sizeclass, we need to potentially
- * move this superblock to another bucket or remove it completely if it
- * is completely full.
- * 
- * Assume the given heap and superblock is locked.
+ * Frees the n blocks in blocks, which belong to the superblocks in sbs,
+ * after sorting them by superblock so that each superblock's heap is
+ * locked once. The sort is stable and takes one pass over blocks that
+ * are already grouped, which they are when they came from
+ * mm_malloc_batch.
  */
-void update_buckets(heap *myheap, int bucketnum, int sizeclass) {
-	superblock *freeblk = myheap->buckets[bucketnum][sizeclass];
-	assert(freeblk != NULL);
-	if (freeblk->head == NULL) {
-		// if the block freelist is empty, then it means this superblock is full
-		// so just remove it from the buckets
-		remove_sb_from_bucket(myheap, bucketnum, sizeclass, freeblk);
+void free_grouped(void **blocks, superblock **sbs, int n) {
+	int i, j;
+	for (i = 1; i < n; ++i) {
+		void *ptr = blocks[i];
+		superblock *sb = sbs[i];
+		for (j = i; j > 0 && sbs[j-1] > sb; --j) {
+			blocks[j] = blocks[j-1];
+			sbs[j] = sbs[j-1];
+		}
+		blocks[j] = ptr;
+		sbs[j] = sb;
+	}
+	int start = 0;
+	for (i = 1; i <= n; ++i) {
+		if (i == n || sbs[i] != sbs[start]) {
+			heap_free(sbs[start], &blocks[start], i - start);
+			start = i;
+		}
+	}
+}
+
+/*
+ * Frees the n blocks in ptrs, which may be of any size. Blocks in size
+ * classes skip the caches and go straight back to their superblocks,
+ * grouped by superblock a batch at a time so that each superblock's
+ * heap is locked once per batch rather than once per block. ptrs
+ * itself is left alone.
+ */
+void mm_free_batch (void **ptrs, int n) {
+	void *blocks[FREE_BATCH];
+	superblock *sbs[FREE_BATCH];
+	int nblocks = 0;
+	int i;
+	for (i = 0; i < n; ++i) {
+		void *ptr = ptrs[i];
+		if (ptr == NULL) {
+			continue;
+		}
+		span *s = find_span(ptr);
+		if (s != NULL) {
+			large_free(s);
+			continue;
+		}
+		superblock *sb = find_superblock(ptr);
+		count_free(sb->size_class, 1);
+		blocks[nblocks] = ptr;
+		sbs[nblocks++] = sb;
+		if (nblocks == FREE_BATCH) {
+			free_grouped(blocks, sbs, nblocks);
+			nblocks = 0;
+		}
+	}
+	if (nblocks > 0) {
+		free_grouped(blocks, sbs, nblocks);
+	}
+}
+
+// ---------------------------------------------------------------------
+// mm_realloc, mm_calloc, aligned allocation
+// ---------------------------------------------------------------------
+
+size_t mm_usable_size (void *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+	span *s = find_span(ptr);
+	if (s != NULL) {
+		return large_usable_size(s, ptr);
+	}
+	return SIZE_CLASSES[find_superblock(ptr)->size_class];
+}
+
+void *mm_realloc (void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return mm_malloc(size);
+	}
+	if (size == 0) {
+		mm_free(ptr);
+		return NULL;
+	}
+	size_t old_size;
+	span *s = find_span(ptr);
+	if (s != NULL) {
+		// a large object stays large, so resize its span if we can
+		if (find_size_class(size) < 0 && large_resize(s, ptr, size)) {
+			return ptr;
+		}
+		old_size = large_usable_size(s, ptr);
 	} else {
-		// otherwise the block freelist isn't empty
-		// now we have to check whether it got fuller and needs to be moved to another fullness bucket
-		double alloc_ratio = (double)freeblk->allocated / (SB_AVAILABLE + (freeblk->n - 1)*SUPERBLOCK_SIZE);
-		if (alloc_ratio > (double)(FULLNESS_DENOM - bucketnum)/FULLNESS_DENOM) {
-			// move it one bucket over
-			assert(bucketnum > 0);
-			remove_sb_from_bucket(myheap, bucketnum, sizeclass, freeblk);
-			insert_sb_into_bucket(myheap, bucketnum-1, sizeclass, freeblk);
+		// stay in the same block as long as it fits and isn't mostly wasted
+		old_size = SIZE_CLASSES[find_superblock(ptr)->size_class];
+		if (size <= old_size && size > old_size / 2) {
+			return ptr;
 		}
 	}
+	void *ret = mm_malloc(size);
+	if (ret == NULL) {
+		return NULL;
+	}
+	memcpy(ret, ptr, size < old_size ? size : old_size);
+	mm_free(ptr);
+	return ret;
 }
 
-void *mm_malloc (size_t size) {
+void *mm_calloc (size_t nmemb, size_t size) {
+	if (size != 0 && nmemb > (size_t)-1 / size) {
+		return NULL;
+	}
+	size *= nmemb;
 	if (size == 0) {
 		return NULL;
 	}
-	int sizeclass = find_size_class(size);
-	if (sizeclass < 0) {
+	if (find_size_class(size) < 0) {
+		// only clears the pages that may have been used before
+		return large_malloc(size, 1);
+	}
+	void *ret = mm_malloc(size);
+	if (ret != NULL) {
+		memset(ret, 0, size);
+	}
+	return ret;
+}
+
+void *mm_memalign (size_t alignment, size_t size) {
+	if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
 		return NULL;
 	}
-	int mycpu = sched_getcpu();
-	assert(mycpu >= 0 && mycpu < NUM_PROCESSORS);
-DEBUG("mm_malloc: cpu %d, size %u, size class %d\n", mycpu, size, sizeclass);
-	// check this heap for free block
-	heap *myheap = HEAPS[mycpu +1];
-	int bucketnum;
-	// lock this heap
-	pthread_mutex_lock(&myheap->lock);
-	superblock *freeblk = search_free(sizeclass, myheap, &bucketnum);
+	if (size == 0) {
+		return NULL;
+	}
+	if (alignment <= 8) {
+		return mm_malloc(size);
+	}
+	// blocks of a size class that's a multiple of alignment are aligned
+	// to it, so use the first of those that's big enough
+	int sizeclass = find_size_class(size);
+	while (sizeclass >= 0 && sizeclass < NUM_SIZE_CLASSES && SIZE_CLASSES[sizeclass] % alignment != 0) {
+		++sizeclass;
+	}
+	if (sizeclass < 0 || sizeclass >= NUM_SIZE_CLASSES) {
+		return large_memalign(alignment, size);
+	}
+	return class_malloc(sizeclass);
+}
+
+int mm_posix_memalign (void **memptr, size_t alignment, size_t size) {
+	if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+		return EINVAL;
+	}
 	void *ret = NULL;
-	if (freeblk != NULL) {
-		pthread_mutex_lock(&freeblk->lock);
-		ret = allocate_block(sizeclass, freeblk);
-		//potentially move the superblock around to another fullness bucket
-		update_buckets(myheap, bucketnum, sizeclass);
-		pthread_mutex_unlock(&freeblk->lock);
-		pthread_mutex_unlock(&myheap->lock);
-		assert(ret != NULL);
-		return ret;
+	if (size > 0 && (ret = mm_memalign(alignment, size)) == NULL) {
+		return ENOMEM;
 	}
-DEBUG("mm_malloc: Checking global heap\n");
-	// unsuccessful in myheap, so check global heap
-	heap *global = HEAPS[0];
-	pthread_mutex_lock(&global->lock);
-	freeblk = search_free(sizeclass, global, &bucketnum);
-	if (freeblk != NULL) {
-		// now we've found one, so transfer it over
-		// remove from global heap's buckets and add to this heap's buckets
-		remove_sb_from_bucket(global, bucketnum, sizeclass, freeblk);
-		insert_sb_into_bucket(myheap, bucketnum, sizeclass, freeblk);
-		// lock this superblock
-		pthread_mutex_lock(&freeblk->lock);
-		// since we've locked the superblock we don't need the global heap lock
-		pthread_mutex_unlock(&global->lock);
-		// change owners
-		freeblk->owner = mycpu+1;
-		// now we continue as if we found a suitable superblock in our own heap
-		ret = allocate_block(sizeclass, freeblk);
-		//potentially move the superblock around to another fullness bucket
-		update_buckets(myheap, bucketnum, sizeclass);
-		pthread_mutex_unlock(&freeblk->lock);
-		pthread_mutex_unlock(&myheap->lock);
-		assert(ret != NULL);
-		return ret;
+	*memptr = ret;
+	return 0;
+}
+
+void *mm_aligned_alloc (size_t alignment, size_t size) {
+	return mm_memalign(alignment, size);
+}
+
+// ---------------------------------------------------------------------
+// fork handlers
+// ---------------------------------------------------------------------
+
+// take every lock before a fork, in the usual order, so the child
+// doesn't start out with a lock some other thread was holding
+// the per cpu and per thread heaps are never waited for two at a time
+// so they can go in any order, and neither are the global heaps
+void mm_atfork_prepare (void) {
+	int i;
+	pthread_mutex_lock(&thread_heaps_lock);
+	for (i = 1; i <= NUM_PROCESSORS; ++i) {
+		LOCK_HEAP(HEAPS[i]);
+	}
+	for (i = FIRST_THREAD_HEAP; i < NUM_HEAPS; ++i) {
+		LOCK_HEAP(HEAPS[i]);
+	}
+	for (i = 0; i < NUM_NODES; ++i) {
+		LOCK_HEAP(HEAPS[global_heap(i)]);
+	}
+	LOCK_PAGEHEAP();
+}
+
+// give them all back afterwards, in the parent and in the child alike
+void mm_atfork_parent (void) {
+	UNLOCK_PAGEHEAP();
+	int i;
+	for (i = 0; i < NUM_HEAPS; ++i) {
+		UNLOCK_HEAP(HEAPS[i]);
+	}
+	pthread_mutex_unlock(&thread_heaps_lock);
+}
+
+// only the thread that forked is left in the child, so the heaps of all
+// the other threads are retired for new threads to take
+void mm_atfork_child (void) {
+	mm_atfork_parent();
+	int i;
+	for (i = FIRST_THREAD_HEAP; i < NUM_HEAPS; ++i) {
+		if (i != MY_HEAP) {
+			HEAPS[i]->retired = 1;
+		}
+	}
+}
+
+// ---------------------------------------------------------------------
+// Statistics
+// ---------------------------------------------------------------------
+
+int mm_stats_num_heaps (void) {
+	return __atomic_load_n(&NUM_HEAPS, __ATOMIC_ACQUIRE);
+}
+
+int mm_stats_num_classes (void) {
+	return NUM_SIZE_CLASSES;
+}
+
+// add what heap h has done with size class sizeclass to out, and the
+// superblocks it has in each fullness bucket
+// assumes h is locked
+void add_heap_stats(heap *h, int sizeclass, mm_heap_stats *out) {
+	heap_counters *c = &h->counters[sizeclass];
+	out->mallocs += c->mallocs;
+	out->frees += c->frees;
+	out->remote_frees += c->remote_frees;
+	out->from_global += c->from_global;
+	out->to_global += c->to_global;
+	out->new_superblocks += c->new_superblocks;
+	out->released += c->released;
+	out->from_other_node += c->from_other_node;
+	int i;
+	for (i = 0; i < out->num_buckets; ++i) {
+		superblock *sb;
+		for (sb = h->buckets[i][sizeclass]; sb != NULL; sb = sb->next) {
+			++out->superblocks[i];
+		}
+	}
+	// a global heap's superblocks all count as emptiest
+	if (h->stacks != NULL) {
+		out->superblocks[out->num_buckets - 1] += __atomic_load_n(&h->stacks[sizeclass].depth, __ATOMIC_RELAXED);
+	}
+}
+
+void mm_stats_heap (int heapnum, int sizeclass, mm_heap_stats *out) {
+	memset(out, 0, sizeof(mm_heap_stats));
+	out->num_buckets = FULLNESS_DENOM < MM_STATS_MAX_BUCKETS ? FULLNESS_DENOM : MM_STATS_MAX_BUCKETS;
+	if (heapnum < 0 || heapnum >= mm_stats_num_heaps() || sizeclass < -1 || sizeclass >= NUM_SIZE_CLASSES) {
+		return;
+	}
+	heap *h = HEAPS[heapnum];
+	out->global = h->global;
+	out->thread = h->thread;
+	LOCK_HEAP(h);
+	out->node = h->node;
+	out->retired = h->retired;
+	out->chunk_pages = h->chunk_pages;
+	if (sizeclass >= 0) {
+		add_heap_stats(h, sizeclass, out);
 	} else {
-		// otherwise we didn't find anything so release the global heap lock and continue
-		pthread_mutex_unlock(&global->lock);
+		int i;
+		for (i = 0; i < NUM_SIZE_CLASSES; ++i) {
+			add_heap_stats(h, i, out);
+		}
 	}
-DEBUG("mm_malloc: mem_sbrking\n");
-	// unsucessful in global heap too, so get new superblock
-	int numblks = 1;
-	if (SIZE_CLASSES[sizeclass] > SB_AVAILABLE) {
-		numblks += (SIZE_CLASSES[sizeclass] - SB_AVAILABLE + SUPERBLOCK_SIZE - 1) / SUPERBLOCK_SIZE;
-	}
-	LOCK_MEM_SBRK(&mem_sbrk_lock);
-	superblock *newblk = mem_sbrk(SUPERBLOCK_SIZE * numblks);
-	UNLOCK_MEM_SBRK(&mem_sbrk_lock);
-	if (newblk != NULL) {
-		// make sure we're not out of memory, otherwise just return NULL
-		init_superblock(mycpu+1, sizeclass, numblks, (char *) newblk);
-		// don't need to lock superblock since only this heap knows about it
-		ret = allocate_block(sizeclass, newblk);
-		if (newblk->head != NULL) {
-			// only add to buckets if this isn't full
-			insert_sb_into_bucket(myheap, FULLNESS_DENOM-1, sizeclass, newblk);
-			update_buckets(myheap, FULLNESS_DENOM - 1, sizeclass);
-		} else {
-			newblk->bucketnum = -1;
+	UNLOCK_HEAP(h);
+}
+
+// the counts of threads that are still running may be a little behind
+void mm_stats_class (int sizeclass, mm_class_stats *out) {
+	memset(out, 0, sizeof(mm_class_stats));
+	if (sizeclass < 0 || sizeclass >= NUM_SIZE_CLASSES) {
+		return;
+	}
+	out->size = SIZE_CLASSES[sizeclass];
+	out->superblock_size = SUPERBLOCK_SIZES[sizeclass];
+	thread_stats *ts;
+	for (ts = __atomic_load_n(&STATS_SLOTS, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next) {
+		out->mallocs += __atomic_load_n(&ts->mallocs[sizeclass], __ATOMIC_RELAXED);
+		out->frees += __atomic_load_n(&ts->frees[sizeclass], __ATOMIC_RELAXED);
+	}
+}
+
+void mm_stats_pages (mm_page_stats *out) {
+	LOCK_PAGEHEAP();
+	out->large_mallocs = PAGEHEAP_LARGE_MALLOCS;
+	out->large_frees = PAGEHEAP_LARGE_FREES;
+	out->sbrk_calls = PAGEHEAP_SBRK_CALLS;
+	out->used = mem_usage();
+	out->committed = mem_committed();
+	out->reserved = mem_reserved();
+	out->free_pages = 0;
+	span *s;
+	for (s = PAGEHEAP_FREE; s != NULL; s = s->next) {
+		out->free_pages += s->npages;
+	}
+	out->dirty_pages = PAGEHEAP_DIRTY;
+	UNLOCK_PAGEHEAP();
+}
+
+// whether a heap has never touched what these are the stats of
+int heap_stats_unused(mm_heap_stats *hs) {
+	int i;
+	for (i = 0; i < hs->num_buckets; ++i) {
+		if (hs->superblocks[i] != 0) {
+			return 0;
 		}
-		assert(ret != NULL);
 	}
-	pthread_mutex_unlock(&myheap->lock);
-	return ret;
+	return hs->mallocs == 0 && hs->frees == 0;
+}
+
+// write out the members of a JSON object holding hs
+void dump_heap_stats(FILE *out, mm_heap_stats *hs) {
+	fprintf(out, "\"mallocs\": %lu, \"frees\": %lu, \"remote_frees\": %lu, "
+	        "\"from_global\": %lu, \"to_global\": %lu, \"new_superblocks\": %lu, "
+	        "\"released\": %lu, \"from_other_node\": %lu, \"superblocks\": [",
+	        hs->mallocs, hs->frees, hs->remote_frees, hs->from_global,
+	        hs->to_global, hs->new_superblocks, hs->released, hs->from_other_node);
+	int i;
+	for (i = 0; i < hs->num_buckets; ++i) {
+		fprintf(out, "%s%d", i > 0 ? ", " : "", hs->superblocks[i]);
+	}
+	fprintf(out, "]");
+}
+
+#ifdef LOCK_PROFILE
+// write out a JSON object holding prof
+void dump_lock_profile(FILE *out, lock_profile *prof) {
+	fprintf(out, "{\"acquisitions\": %lu, \"contended\": %lu, \"wait_cycles\": %llu}",
+	        prof->acquisitions, prof->contended, (unsigned long long)prof->wait_cycles);
+}
+#endif
+
+#ifdef LATENCY_PROFILE
+// what the latency histograms say about a call, in cycles
+struct latency_summary_t {
+	unsigned long samples;
+	u_int64_t p50;
+	u_int64_t p99;
+	u_int64_t p999;
+	u_int64_t max;
+};
+typedef struct latency_summary_t latency_summary;
+
+const char *LAT_CALL_NAMES[2] = {"malloc", "free"};
+const char *LAT_PATH_NAMES[LAT_PATHS] = {"cache", "heap", "remote", "global", "page heap"};
+
+// the upper end of the bucket that the sample of the given rank is in
+u_int64_t latency_rank(unsigned long *hist, unsigned long rank) {
+	unsigned long seen = 0;
+	int b;
+	for (b = 0; b < LAT_BUCKETS - 1; ++b) {
+		seen += hist[b];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return latency_bucket_low(b + 1) - 1;
 }
 
 /*
- * Function that indicates that there is a new free space in
- * superblock blk by updating its freelist. 
- * Assumes lock to blk has already been obtained.
+ * Merges the histograms of every thread for call, of group (or every
+ * group, for -1) and path (or every path, for -1),
+ * and puts its percentiles in out. They're the upper ends of buckets, so
+ * they may be up to an LAT_SUB'th over.
+ * The histograms of threads that are still running may be a little behind.
  */
-void update_freelist(superblock *blk, void *ptr) {
-	freelist *currfree = blk->head;
-	blk->head = (freelist *)ptr;
-	//check what old head was and update stats accordingly
-	if (currfree == NULL) {
-		blk->head->next = 0;
+void latency_summarize(int call, int group, int path, latency_summary *out) {
+	unsigned long hist[LAT_BUCKETS];
+	memset(hist, 0, sizeof(hist));
+	int first_group = group < 0 ? 0 : group;
+	int last_group = group < 0 ? LAT_GROUPS - 1 : group;
+	int first_path = path < 0 ? 0 : path;
+	int last_path = path < 0 ? LAT_PATHS - 1 : path;
+	thread_stats *ts;
+	int g, p, b;
+	for (ts = __atomic_load_n(&STATS_SLOTS, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next) {
+		for (g = first_group; g <= last_group; ++g) {
+			for (p = first_path; p <= last_path; ++p) {
+				unsigned int *h = LAT_HISTOGRAM(ts, call, g, p);
+				for (b = 0; b < LAT_BUCKETS; ++b) {
+					hist[b] += __atomic_load_n(&h[b], __ATOMIC_RELAXED);
+				}
+			}
+		}
+	}
+	memset(out, 0, sizeof(latency_summary));
+	for (b = 0; b < LAT_BUCKETS; ++b) {
+		out->samples += hist[b];
+		if (hist[b] != 0) {
+			out->max = latency_bucket_low(b + 1) - 1;
+		}
+	}
+	if (out->samples == 0) {
+		return;
+	}
+	out->p50 = latency_rank(hist, (out->samples * 500 + 999) / 1000);
+	out->p99 = latency_rank(hist, (out->samples * 990 + 999) / 1000);
+	out->p999 = latency_rank(hist, (out->samples * 999 + 999) / 1000);
+}
+
+// write out a JSON object holding the latency of call, group and path
+void dump_latency(FILE *out, int call, int group, int path, latency_summary *ls) {
+	fprintf(out, "{\"call\": \"%s\", \"group\": %d, \"max_size\": ", LAT_CALL_NAMES[call], group);
+	if (group < 0 || group == LAT_GROUP_LARGE) {
+		fprintf(out, "null");
 	} else {
-		unsigned int curroff = (unsigned int)((char *)currfree - (char*)blk);
-		assert(curroff > 0 && curroff < SUPERBLOCK_SIZE);
-		blk->head->next = curroff;
+		fprintf(out, "%lu", (unsigned long)latency_group_max(group));
 	}
-	blk->head->n = 1;
-	assert(blk->head != NULL);
+	fprintf(out, ", \"path\": ");
+	if (path < 0) {
+		fprintf(out, "null");
+	} else {
+		fprintf(out, "\"%s\"", LAT_PATH_NAMES[path]);
+	}
+	fprintf(out, ", \"samples\": %lu, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+	        ls->samples, (unsigned long long)ls->p50, (unsigned long long)ls->p99,
+	        (unsigned long long)ls->p999, (unsigned long long)ls->max);
 }
+#endif
 
+// size classes nobody has used are left out, and the locks are only
+// there in a build with LOCK_PROFILE, the latencies in one with
+// LATENCY_PROFILE
+void mm_stats_dump (FILE *out) {
+	mm_heap_stats hs;
+	mm_class_stats cs;
+	mm_page_stats ps;
+	int i, j;
+	unsigned long handoffs = 0;
+	unsigned long remote_handoffs = 0;
+	int num_heaps = mm_stats_num_heaps();
+	fprintf(out, "{\n  \"heaps\": [");
+	for (i = 0; i < num_heaps; ++i) {
+		mm_stats_heap(i, -1, &hs);
+		handoffs += hs.from_global;
+		remote_handoffs += hs.from_other_node;
+		fprintf(out, "%s\n    {\"heap\": %d, \"node\": %d, \"global\": %d, \"thread\": %d, \"retired\": %d, \"chunk_pages\": %ld, ",
+		        i > 0 ? "," : "", i, hs.node, hs.global, hs.thread, hs.retired, hs.chunk_pages);
+		dump_heap_stats(out, &hs);
+		fprintf(out, ", \"classes\": [");
+		int first = 1;
+		for (j = 0; j < NUM_SIZE_CLASSES; ++j) {
+			mm_stats_heap(i, j, &hs);
+			if (heap_stats_unused(&hs)) {
+				continue;
+			}
+			fprintf(out, "%s\n      {\"class\": %d, \"size\": %lu, ", first ? "" : ",", j, (unsigned long)SIZE_CLASSES[j]);
+			dump_heap_stats(out, &hs);
+			fprintf(out, "}");
+			first = 0;
+		}
+		fprintf(out, "]}");
+	}
+	fprintf(out, "\n  ],\n  \"classes\": [");
+	int first = 1;
+	for (j = 0; j < NUM_SIZE_CLASSES; ++j) {
+		mm_stats_class(j, &cs);
+		if (cs.mallocs == 0 && cs.frees == 0) {
+			continue;
+		}
+		fprintf(out, "%s\n    {\"class\": %d, \"size\": %lu, \"superblock_size\": %lu, \"mallocs\": %lu, \"frees\": %lu}",
+		        first ? "" : ",", j, (unsigned long)cs.size, (unsigned long)cs.superblock_size, cs.mallocs, cs.frees);
+		first = 0;
+	}
+#ifdef LOCK_PROFILE
+	fprintf(out, "\n  ],\n  \"locks\": {\"heaps\": [");
+	for (i = 0; i < num_heaps; ++i) {
+		fprintf(out, "%s", i > 0 ? ", " : "");
+		dump_lock_profile(out, &HEAPS[i]->lock_profile);
+	}
+	fprintf(out, "], \"page_heap\": ");
+	dump_lock_profile(out, &PAGEHEAP_LOCK_PROFILE);
+	fprintf(out, "}");
+#else
+	fprintf(out, "\n  ]");
+#endif
+#ifdef LATENCY_PROFILE
+	// in cycles, for every group (-1) and each one, large objects being
+	// LAT_GROUP_LARGE, by every path (null) and each one, if there are any
+	latency_summary ls;
+	int call, p;
+	fprintf(out, ",\n  \"latency\": {\"sample\": %lu, \"cycles_per_sec\": %.0f, \"calls\": [",
+	        LATENCY_SAMPLE, read_counter_frequency());
+	first = 1;
+	for (call = LAT_MALLOC; call <= LAT_FREE; ++call) {
+		for (j = -1; j < LAT_GROUPS; ++j) {
+			for (p = -1; p < LAT_PATHS; ++p) {
+				latency_summarize(call, j, p, &ls);
+				if (ls.samples == 0) {
+					continue;
+				}
+				fprintf(out, "%s\n    ", first ? "" : ",");
+				dump_latency(out, call, j, p, &ls);
+				first = 0;
+			}
+		}
+	}
+	fprintf(out, "\n  ]}");
+#endif
+	// superblocks handed from a global heap to a cpu heap of its own node
+	// and of another node
+	fprintf(out, ",\n  \"numa\": {\"nodes\": %d, \"local_handoffs\": %lu, \"remote_handoffs\": %lu}",
+	        NUM_NODES, handoffs - remote_handoffs, remote_handoffs);
+	mm_stats_pages(&ps);
+	fprintf(out, ",\n  \"pages\": {\"large_mallocs\": %lu, \"large_frees\": %lu, "
+	        "\"sbrk_calls\": %lu, \"used\": %ld, \"committed\": %ld, \"reserved\": %ld, "
+	        "\"free_pages\": %ld, \"dirty_pages\": %ld}\n}\n",
+	        ps.large_mallocs, ps.large_frees, ps.sbrk_calls, ps.used,
+	        ps.committed, ps.reserved, ps.free_pages, ps.dirty_pages);
+}
 
-void mm_free (void *ptr) {
-DEBUG("mm_free: start\n");
-	//find superblock that this pointer is in
-	superblock *thisblk = (superblock *)((((char*)ptr - SUPERBLOCK_START)/SUPERBLOCK_SIZE * SUPERBLOCK_SIZE)+ SUPERBLOCK_START);
-	//lock superblock
-	pthread_mutex_lock(&thisblk->lock);
-	//free this (sub)block and update information
-	update_freelist(thisblk, ptr);
-	thisblk->allocated -= SIZE_CLASSES[thisblk->size_class];
-	//find its owner heap
-	int owner = thisblk->owner;
-	heap *thisheap = HEAPS[owner];
-	assert(owner >= 0 && owner <= NUM_PROCESSORS);
-	pthread_mutex_unlock(&thisblk->lock);
-	
-	// just stop here if this block belongs to the global heap to avoid deadlock
-	if (owner == 0) {
+// dump the statistics where CAMEL_STATS says, as the process exits
+void stats_atexit() {
+	if (strcmp(STATS_PATH, "-") == 0) {
+		mm_stats_dump(stderr);
 		return;
 	}
-	
-	// now have to try to get heap lock first to avoid deadlock with mm_malloc
-	pthread_mutex_lock(&thisheap->lock);
-	pthread_mutex_lock(&thisblk->lock);
-	
-	// we can continue if it's still owned by same heap
-	// otherwise some other thread intervened so we don't need to do anything
-	if (owner == thisblk->owner) {
-		int bucketnum = thisblk->bucketnum;
-		assert(bucketnum >= -1 && bucketnum < FULLNESS_DENOM);
-		//determine how much of this superblock has been allocated
-		double alloc_ratio = (double)thisblk->allocated/(SB_AVAILABLE + (thisblk->n - 1)*SUPERBLOCK_SIZE);
-		//check if this block should be moved to another fullness bucket
-		if (alloc_ratio <= (double)(FULLNESS_DENOM - bucketnum - 1)/FULLNESS_DENOM){
-			if (bucketnum >= 0 && bucketnum < FULLNESS_DENOM-1) { //but only if it's not full nor completely empty
-DEBUG("mm_free: moving buckets\n");
-				remove_sb_from_bucket(thisheap, bucketnum, thisblk->size_class, thisblk);
-				assert(thisblk->head != NULL);
-				insert_sb_into_bucket(thisheap, bucketnum + 1, thisblk->size_class, thisblk);
-			} else if (bucketnum == -1 && thisblk->head != NULL) {
-				// need to put it into a bucket if it's not completely full anymore
-				insert_sb_into_bucket(thisheap, FULLNESS_DENOM-1, thisblk->size_class, thisblk);
-			}
+	FILE *out = fopen(STATS_PATH, "w");
+	if (out == NULL) {
+		perror(STATS_PATH);
+		return;
+	}
+	mm_stats_dump(out);
+	fclose(out);
+}
+
+#ifdef LOCK_PROFILE
+// ---------------------------------------------------------------------
+// Lock profile
+// ---------------------------------------------------------------------
+
+void print_lock_profile(FILE *out, const char *name, lock_profile *prof) {
+	fprintf(out, "%-16s %12lu %12lu %16llu %12llu\n", name, prof->acquisitions, prof->contended,
+	        (unsigned long long)prof->wait_cycles,
+	        (unsigned long long)(prof->contended > 0 ? prof->wait_cycles / prof->contended : 0));
+}
+
+// print every lock's profile to stderr, as the process exits
+// the per cpu heaps are also added up, since they're all the same kind
+// of lock, and the thread heaps are only added up
+void lock_profile_report() {
+	lock_profile total;
+	memset(&total, 0, sizeof(lock_profile));
+	char name[32];
+	int i;
+	fprintf(stderr, "%-16s %12s %12s %16s %12s\n", "lock", "acquired", "contended", "wait cycles", "per wait");
+	for (i = 0; i < NUM_NODES; ++i) {
+		snprintf(name, sizeof(name), "global heap %d", i);
+		print_lock_profile(stderr, name, &HEAPS[global_heap(i)]->lock_profile);
+	}
+	for (i = 1; i <= NUM_PROCESSORS; ++i) {
+		lock_profile *prof = &HEAPS[i]->lock_profile;
+		snprintf(name, sizeof(name), "heap %d", i);
+		print_lock_profile(stderr, name, prof);
+		total.acquisitions += prof->acquisitions;
+		total.contended += prof->contended;
+		total.wait_cycles += prof->wait_cycles;
+	}
+	print_lock_profile(stderr, "all cpu heaps", &total);
+	if (THREAD_HEAPS_ON) {
+		memset(&total, 0, sizeof(lock_profile));
+		for (i = FIRST_THREAD_HEAP; i < NUM_HEAPS; ++i) {
+			lock_profile *prof = &HEAPS[i]->lock_profile;
+			total.acquisitions += prof->acquisitions;
+			total.contended += prof->contended;
+			total.wait_cycles += prof->wait_cycles;
 		}
+		print_lock_profile(stderr, "all thread heaps", &total);
+	}
+	print_lock_profile(stderr, "page heap", &PAGEHEAP_LOCK_PROFILE);
+}
+#endif
+
+#ifdef LATENCY_PROFILE
+// ---------------------------------------------------------------------
+// Latency profile
+// ---------------------------------------------------------------------
+
+// print the latency of call, group and path if there is any, times
+// scale, which turns cycles into the units being printed
+void print_latency(FILE *out, int call, int group, int path, double scale) {
+	latency_summary ls;
+	latency_summarize(call, group, path, &ls);
+	if (ls.samples == 0) {
+		return;
+	}
+	char size[16];
+	if (group < 0) {
+		strcpy(size, "all");
+	} else if (group == LAT_GROUP_LARGE) {
+		strcpy(size, "large");
+	} else {
+		snprintf(size, sizeof(size), "<=%lu", (unsigned long)latency_group_max(group));
+	}
+	fprintf(out, "%-6s %-9s %-7s %12lu %10.0f %10.0f %10.0f %12.0f\n", LAT_CALL_NAMES[call],
+	        path < 0 ? "all" : LAT_PATH_NAMES[path], size, ls.samples,
+	        ls.p50 * scale, ls.p99 * scale, ls.p999 * scale, ls.max * scale);
+}
 
-		//check if stuff can be moved to global heap
-		if (thisheap->num_superblocks > SB_RESERVE && thisblk->allocated < ALLOC_THRESHOLD){
-			assert(thisblk->head != NULL); // shouldn't be full
-DEBUG("mm_free: moving to global heap\n");
-			//change the owner of this block
-			thisblk->owner = 0;
-			// find out which bucket it's in
-			bucketnum = thisblk->bucketnum;
-			assert(bucketnum >= -1 && bucketnum < FULLNESS_DENOM);
-			// move to global heap
-			heap *global = HEAPS[0];
-			pthread_mutex_lock(&global->lock);
-			if (bucketnum >= 0) {
-				// even though this is free, it may not be in a bucket
-				remove_sb_from_bucket(thisheap, bucketnum, thisblk->size_class, thisblk);
+// print the latency of mm_malloc and mm_free to stderr, as the process
+// exits: by path over every size, and then by group of size classes
+void latency_report() {
+	double freq = read_counter_frequency();
+	double scale = freq > 0 ? 1e9 / freq : 1;
+	int call, group, path;
+	fprintf(stderr, "latency of 1 in %lu calls, in %s\n", LATENCY_SAMPLE, freq > 0 ? "ns" : "cycles");
+	fprintf(stderr, "%-6s %-9s %-7s %12s %10s %10s %10s %12s\n",
+	        "call", "path", "size", "samples", "p50", "p99", "p99.9", "max");
+	for (call = LAT_MALLOC; call <= LAT_FREE; ++call) {
+		for (path = -1; path < LAT_PATHS; ++path) {
+			print_latency(stderr, call, -1, path, scale);
+		}
+	}
+	for (call = LAT_MALLOC; call <= LAT_FREE; ++call) {
+		for (group = 0; group < LAT_GROUPS; ++group) {
+			for (path = -1; path < LAT_PATHS; ++path) {
+				print_latency(stderr, call, group, path, scale);
 			}
-			// if the block was empty enough to be moved to global heap, then is empty enough
-			// to be put in emptiest bucket.
-			insert_sb_into_bucket(global, FULLNESS_DENOM-1, thisblk->size_class, thisblk);
-			pthread_mutex_unlock(&global->lock);
-	
 		}
 	}
-	
-	pthread_mutex_unlock(&thisblk->lock);
-	pthread_mutex_unlock(&thisheap->lock);
-DEBUG("mm_free: exit\n");
 }
+#endif
 
 // ---------------------------------------------------------------------
 // testing code
@@ -721,14 +3844,13 @@ DEBUG("mm_free: exit\n");
 
 // assume mm_init has been called
 void test_superblock() {
-	char *sb = mem_sbrk(SUPERBLOCK_SIZE);
-	init_superblock(0, 0, 1, sb);
-	debug_superblock(sb);
+	char *sb = alloc_superblock_pages(SUPERBLOCK_SIZES[0] / PAGE_SIZE);
+	debug_superblock(init_superblock(0, 0, sb));
 }
 
 void test_heap() {
 	int i;
-	for (i = 0; i < NUM_PROCESSORS+1; ++i) {
+	for (i = 0; i < NUM_HEAPS; ++i) {
 		printf("heap %d:\n", i);
 		debug_heap((char*)HEAPS[i]);
 	}
@@ -8,6 +8,84 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+/* Free ptr given the size it was allocated with by mm_malloc or
+ * mm_calloc, or its mm_usable_size, which saves looking the size up.
+ * Any other size is undefined behaviour: the block may go into the
+ * wrong size class's freelist and be handed out again as that size.
+ * Only debug builds check it */
+extern void mm_free_sized (void *ptr, size_t size);
+extern void *mm_realloc (void *ptr, size_t size);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign (size_t alignment, size_t size);
+extern int mm_posix_memalign (void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc (size_t alignment, size_t size);
+extern size_t mm_usable_size (void *ptr);
+
+/* Allocate n blocks of size bytes into out, returning how many were
+ * allocated (less than n only if we're out of memory), and free n
+ * blocks of any sizes at once. Cheaper than one call per block */
+extern int mm_malloc_batch (size_t size, int n, void **out);
+extern void mm_free_batch (void **ptrs, int n);
+
+/* Statistics, see mm_stats_heap and friends */
+#define MM_STATS_MAX_BUCKETS 8
+
+typedef struct {
+    unsigned long mallocs;          /* blocks handed out of the heap's superblocks */
+    unsigned long frees;            /* blocks freed back into them */
+    unsigned long remote_frees;     /* of those, blocks other processors freed */
+    unsigned long from_global;      /* superblocks taken from the global heap */
+    unsigned long to_global;        /* superblocks given to the global heap */
+    unsigned long new_superblocks;  /* superblocks made out of pages from the page heap */
+    unsigned long released;         /* empty superblocks given back to the page heap */
+    unsigned long from_other_node;  /* of from_global, taken from another node's global heap */
+    int node;                       /* the NUMA node the heap is for */
+    int global;                     /* whether it's that node's global heap */
+    int thread;                     /* whether it's a thread's own heap */
+    int retired;                    /* whether that thread has exited */
+    long chunk_pages;               /* pages it holds for superblocks it hasn't made yet */
+    int num_buckets;
+    int superblocks[MM_STATS_MAX_BUCKETS];  /* right now, per fullness bucket, fullest first */
+} mm_heap_stats;
+
+typedef struct {
+    size_t size;
+    size_t superblock_size;         /* bytes in each of its superblocks */
+    unsigned long mallocs;          /* calls, cache hits included */
+    unsigned long frees;
+} mm_class_stats;
+
+typedef struct {
+    unsigned long large_mallocs;
+    unsigned long large_frees;
+    unsigned long sbrk_calls;       /* made by the page heap */
+    long used;          /* bytes taken from mem_sbrk */
+    long committed;     /* bytes of the data segment that are usable */
+    long reserved;      /* bytes of address space set aside for it */
+    long free_pages;    /* pages in the page heap's free list */
+    long dirty_pages;   /* of those, pages that may be resident */
+} mm_page_stats;
+
+/* heap 0 is the global heap of NUMA node 0, heaps 1 to the number of
+ * processors belong to one processor each, and any after those are the
+ * global heaps of the other nodes. With CAMEL_THREAD_HEAPS=1 the heaps
+ * of threads come last; their number grows as threads start, and the
+ * heap of a thread that has exited goes to the next new thread.
+ * mm_stats_heap gives the counts of one size class, or of all of them
+ * together if sizeclass is -1 */
+extern int mm_stats_num_heaps (void);
+extern int mm_stats_num_classes (void);
+extern void mm_stats_heap (int heap, int sizeclass, mm_heap_stats *out);
+extern void mm_stats_class (int sizeclass, mm_class_stats *out);
+extern void mm_stats_pages (mm_page_stats *out);
+/* all of the above as JSON, which mm_init also arranges to happen at
+ * exit if CAMEL_STATS is set, to that file (or stderr if it's "-") */
+extern void mm_stats_dump (FILE *out);
+
+/* For pthread_atfork, if the process may fork while other threads are allocating */
+extern void mm_atfork_prepare (void);
+extern void mm_atfork_parent (void);
+extern void mm_atfork_child (void);
 
 /* Team information */
 typedef struct {
@@ -9,9 +9,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "memlib.h"
 
@@ -19,6 +21,14 @@
 char *dseg_lo = NULL, *dseg_hi = NULL;
 long dseg_size;  /* Maximum size of data segment */
 
+static char *dseg_commit_hi = NULL;  /* End of the readable and writable part */
+
+/* Held while more of the reservation is committed. mem_sbrk only needs
+ * it when it crosses dseg_commit_hi; otherwise it just bumps dseg_hi. */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int huge_mode = MEM_HUGE_NONE;  /* How the segment is committed */
+
 static int page_size;
 
 /* Align pointer to closest page boundary downwards */
@@ -34,34 +44,104 @@ int mem_init (void)
     /* Get system page size */
     page_size = (int) getpagesize();
 
-    /* Allocate heap */
-    dseg_lo = (char *) malloc(DSEG_MAX + 2*page_size);
-    if (!dseg_lo)
+    /* Reserve address space for the heap, without any memory behind it
+     * yet. Ask for less if the OS won't give us that much. The start is
+     * aligned to a huge page, so huge pages can back the segment from its
+     * first byte on; whatever is cut off to get there is given back. */
+    void *seg = MAP_FAILED;
+    for (dseg_size = DSEG_MAX; dseg_size >= DSEG_MIN; dseg_size /= 2) {
+        seg = mmap(NULL, dseg_size + HUGE_PAGE_SIZE, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (seg != MAP_FAILED)
+            break;
+    }
+    if (seg == MAP_FAILED)
         return -1;
 
-    /* align heap to the next page boundary */
-    dseg_lo = (char *) PAGE_ALIGN_UP(dseg_lo);
+    char *aligned = (char *)(((unsigned long)seg + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    if (aligned > (char *)seg)
+        munmap(seg, aligned - (char *)seg);
+    munmap(aligned + dseg_size, (char *)seg + HUGE_PAGE_SIZE - aligned);
+
+    dseg_lo = aligned;
     dseg_hi = dseg_lo-1;
-    dseg_size = DSEG_MAX;
+    dseg_commit_hi = dseg_lo;
+
+
+    return 0;
+}
 
 
+/* Make [addr, addr+len) of the reservation readable and writable, backed
+ * the way mem_huge_pages asked for. If huge pages can't be had from
+ * hugetlbfs, we settle for transparent ones from then on. A failed
+ * MAP_FIXED mmap may already have unmapped the range, so it gets
+ * reserved again before falling back. */
+static int mem_commit (char *addr, long len)
+{
+    if (huge_mode == MEM_HUGE_HUGETLB) {
+        void *got = mmap(addr, len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+        if (got != MAP_FAILED)
+            return 0;
+        huge_mode = MEM_HUGE_THP;
+        got = mmap(addr, len, PROT_NONE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+        if (got == MAP_FAILED)
+            return -1;
+    }
+    if (mprotect(addr, len, PROT_READ | PROT_WRITE))
+        return -1;
+    if (huge_mode == MEM_HUGE_THP)
+        madvise(addr, len, MADV_HUGEPAGE);
     return 0;
 }
 
 
+/* Commit the reservation up to and including new_hi, a chunk at a time,
+ * unless another thread got there first */
+static int mem_commit_to (char *new_hi)
+{
+    int ret = 0;
+    pthread_mutex_lock(&commit_lock);
+    if (new_hi >= dseg_commit_hi) {
+        long chunk = huge_mode != MEM_HUGE_NONE ? HUGE_PAGE_SIZE : DSEG_COMMIT_CHUNK;
+        long grow = new_hi + 1 - dseg_commit_hi;
+        grow = (grow + chunk - 1) / chunk * chunk;
+        if (dseg_commit_hi + grow > dseg_lo + dseg_size)
+            grow = dseg_lo + dseg_size - dseg_commit_hi;
+        if (mem_commit(dseg_commit_hi, grow))
+            ret = -1;
+        else
+            __atomic_store_n(&dseg_commit_hi, dseg_commit_hi + grow, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&commit_lock);
+    return ret;
+}
+
+
+/* Safe to call from several threads at once, without a lock: the break
+ * moves with a compare and swap, and only once the memory up to the new
+ * break has been committed, so a failed commit loses nothing */
 void *mem_sbrk (ptrdiff_t increment)
 {
-    char *new_hi = dseg_hi + increment;
-    char *old_hi = dseg_hi;
-    long dseg_cursize = dseg_hi - dseg_lo + 1;
+    char *old_hi = __atomic_load_n(&dseg_hi, __ATOMIC_RELAXED);
+    char *new_hi;
 
     assert(increment > 0);
 
-    /* Resize data segment, if the memory is available */
-    if (new_hi > dseg_lo + dseg_size)
-        return NULL;
-    dseg_hi = new_hi;
-    dseg_cursize = dseg_hi - dseg_lo + 1;
+    do {
+        new_hi = old_hi + increment;
+
+        /* Resize data segment, if the memory is available */
+        if (new_hi >= dseg_lo + dseg_size)
+            return NULL;
+
+        if (new_hi >= __atomic_load_n(&dseg_commit_hi, __ATOMIC_ACQUIRE) &&
+            mem_commit_to(new_hi))
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&dseg_hi, &old_hi, new_hi, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 
     return (void *)(old_hi + 1);
 }
@@ -71,12 +151,66 @@ int mem_pagesize (void)
     return page_size;
 }
 
-int mem_usage (void)
+long mem_usage (void)
 {
   /* hack for libc */
   if (dseg_lo != NULL && dseg_hi == NULL) {
     dseg_hi = sbrk(0);
   }
-    return dseg_hi - dseg_lo;
+    return __atomic_load_n(&dseg_hi, __ATOMIC_RELAXED) - dseg_lo;
+}
+
+/* Bytes of the segment that have been made usable so far */
+long mem_committed (void)
+{
+    return __atomic_load_n(&dseg_commit_hi, __ATOMIC_RELAXED) - dseg_lo;
+}
+
+/* Bytes of address space set aside for the segment */
+long mem_reserved (void)
+{
+    return dseg_size;
 }
  
+
+/* Give the physical pages in [addr, addr+len) back to the OS.
+ * The range stays part of the data segment and reads back as zeros
+ * the next time it is touched. addr and len must be page aligned.
+ * With huge pages only the huge pages that lie entirely in the range go
+ * back, so none get split up, and the rest of the range is cleared. */
+void mem_decommit (void *addr, size_t len)
+{
+    assert(PAGE_ALIGN(addr) == addr && len % page_size == 0);
+    assert((char *)addr >= dseg_lo && (char *)addr + len <= dseg_hi + 1);
+    if (huge_mode == MEM_HUGE_NONE) {
+        madvise(addr, len, MADV_DONTNEED);
+        return;
+    }
+    char *lo = (char *)addr;
+    char *hi = lo + len;
+    char *huge_lo = dseg_lo + (lo - dseg_lo + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    char *huge_hi = dseg_lo + (hi - dseg_lo) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (huge_lo >= huge_hi) {
+        memset(lo, 0, len);
+        return;
+    }
+    memset(lo, 0, huge_lo - lo);
+    madvise(huge_lo, huge_hi - huge_lo, MADV_DONTNEED);
+    memset(huge_hi, 0, hi - huge_hi);
+}
+
+/* Back the parts of the segment that haven't been committed yet with
+ * huge pages, as one of the MEM_HUGE_ modes. Call it right after
+ * mem_init, so that's all of it.
+ * Returns the mode that will be tried first. */
+int mem_huge_pages (int mode)
+{
+    huge_mode = mode;
+    /* finish off the chunk that's committed so it ends on a huge page */
+    if (huge_mode != MEM_HUGE_NONE && (dseg_commit_hi - dseg_lo) % HUGE_PAGE_SIZE != 0) {
+        long rest = HUGE_PAGE_SIZE - (dseg_commit_hi - dseg_lo) % HUGE_PAGE_SIZE;
+        if (mprotect(dseg_commit_hi, rest, PROT_READ | PROT_WRITE) == 0)
+            dseg_commit_hi += rest;
+    }
+    return huge_mode;
+}
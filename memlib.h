@@ -15,7 +15,15 @@
 #endif
 
 
-#define DSEG_MAX 40*1024*1024  /* 40 Mb */
+#define DSEG_MAX (64L*1024*1024*1024)  /* 64 Gb of address space */
+#define DSEG_MIN (40L*1024*1024)  /* settle for no less than 40 Mb */
+#define DSEG_COMMIT_CHUNK (1024*1024)  /* commit the segment 1 Mb at a time */
+#define HUGE_PAGE_SIZE (2*1024*1024)  /* the segment is aligned to this */
+
+/* Ways to back the segment with huge pages, see mem_huge_pages */
+#define MEM_HUGE_NONE 0     /* regular pages */
+#define MEM_HUGE_THP 1      /* transparent huge pages, with madvise */
+#define MEM_HUGE_HUGETLB 2  /* MAP_HUGETLB, where huge pages are set aside */
 
 extern char *dseg_lo, *dseg_hi;
 extern long dseg_size;
@@ -23,7 +31,11 @@ extern long dseg_size;
 extern int mem_init (void);
 extern void *mem_sbrk (ptrdiff_t increment);
 extern int mem_pagesize (void);
-extern int mem_usage (void);
+extern long mem_usage (void);
+extern long mem_committed (void);
+extern long mem_reserved (void);
+extern void mem_decommit (void *addr, size_t len);
+extern int mem_huge_pages (int mode);
 
 #endif /* __MEMLIB_H_ */
 
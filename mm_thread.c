@@ -1,5 +1,7 @@
 #include "mm_thread.h"
 
+#include <stdio.h>
+
 
 /* Set thread attributes */
 
@@ -28,13 +30,17 @@ int getNumProcessors (void)
 		// "processor".
   
 	        int MAX_LINE_SIZE = 512;
-		char line[MAX_LINE_SIZE];
+		char line[MAX_LINE_SIZE + 1];
 		int fd = open ("/proc/cpuinfo", O_RDONLY);
-		if (!fd) {
+		if (fd < 0) {
 			return 1;
 		} else {
 			int bytes;
-			while ( (bytes = read (fd, line, MAX_LINE_SIZE)) != 0) {
+			// the end of each read is kept for the next one, in case a
+			// "processor" is split between them
+			int keep = 0;
+			while ( (bytes = read (fd, line + keep, MAX_LINE_SIZE - keep)) > 0) {
+				line[keep + bytes] = '\0';
 				char * str = line;
 				while (str) {
 					str = strstr(str, "processor");
@@ -43,8 +49,14 @@ int getNumProcessors (void)
 						str++;
 					}
 				}
+				int len = keep + bytes;
+				keep = len < 8 ? len : 8;
+				memmove(line, line + len - keep, keep);
 			}
 			close (fd);
+			if (!np) {
+				np = 1;
+			}
 			return np;
 		}
 	} else {
@@ -52,6 +64,64 @@ int getNumProcessors (void)
 	}
 }
 
+/* Parse a list of processors like "0-3,8-11" and set cpu_node[cpu] to
+ * node for each one below ncpus */
+static void parseCpuList (const char *list, int node, int *cpu_node, int ncpus)
+{
+	while (*list >= '0' && *list <= '9') {
+		int lo = 0, hi;
+		while (*list >= '0' && *list <= '9') {
+			lo = lo * 10 + (*list++ - '0');
+		}
+		hi = lo;
+		if (*list == '-') {
+			list++;
+			hi = 0;
+			while (*list >= '0' && *list <= '9') {
+				hi = hi * 10 + (*list++ - '0');
+			}
+		}
+		for (; lo <= hi && lo < ncpus; lo++) {
+			cpu_node[lo] = node;
+		}
+		if (*list == ',') {
+			list++;
+		}
+	}
+}
+
+/* Fill in the NUMA node of each of the ncpus processors, from what
+ * /sys/devices/system/node says, reading it ourselves for the same
+ * reason as getNumProcessors. Processors no node lists are put on
+ * node 0. Returns the number of nodes, the highest node number plus
+ * one, which is 1 if there's no NUMA information at all. */
+int getCpuNodes (int *cpu_node, int ncpus, int maxnodes)
+{
+	int i, node;
+	int nnodes = 1;
+	for (i = 0; i < ncpus; i++) {
+		cpu_node[i] = 0;
+	}
+	for (node = 0; node < maxnodes; node++) {
+		char path[64];
+		char list[1024];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		int fd = open (path, O_RDONLY);
+		if (fd < 0) {
+			continue;
+		}
+		int bytes = read (fd, list, sizeof(list) - 1);
+		close (fd);
+		if (bytes <= 0) {
+			continue;
+		}
+		list[bytes] = '\0';
+		parseCpuList(list, node, cpu_node, ncpus);
+		nnodes = node + 1;
+	}
+	return nnodes;
+}
+
 int getTID(void) {
   return syscall(__NR_gettid);
 }
@@ -24,6 +24,8 @@ extern void initialize_pthread_attr(int detachstate, int schedpolicy, int priori
 
 extern int getNumProcessors (void);
 
+extern int getCpuNodes (int *cpu_node, int ncpus, int maxnodes);
+
 extern int getTID(void);
 
 extern void setCPU (int n); 
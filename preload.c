@@ -0,0 +1,232 @@
+/* $Id$ */
+
+/*
+ * Stands in for the C library's malloc and friends, so any program can
+ * run on camel with
+ *
+ *  LD_PRELOAD=./libcamel.so program
+ *
+ * The allocator is set up the first time anything is allocated. Whatever
+ * the set up itself allocates, on the thread doing it, comes out of a
+ * small static arena instead, and other threads wait until it's done.
+ * Pointers that didn't come from us (or from the arena) are never freed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "malloc.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+// how far mm_init has got
+#define CAMEL_UNINITIALIZED 0
+#define CAMEL_INITIALIZING 1
+#define CAMEL_READY 2
+
+static int camel_state = CAMEL_UNINITIALIZED;
+
+// the thread running mm_init
+static pthread_t camel_init_thread;
+
+// memory handed out while mm_init runs, which is never given back
+#define BOOT_ARENA_SIZE 65536
+#define BOOT_HSIZE 16
+
+static char boot_arena[BOOT_ARENA_SIZE] __attribute__((aligned(64)));
+static size_t boot_used = 0;
+
+static int from_boot_arena (void *ptr)
+{
+	return (char *)ptr >= boot_arena && (char *)ptr < boot_arena + BOOT_ARENA_SIZE;
+}
+
+// allocate from the arena, with the size kept just before the block
+static void *boot_malloc (size_t size)
+{
+	size_t need = (size + BOOT_HSIZE + BOOT_HSIZE - 1) / BOOT_HSIZE * BOOT_HSIZE;
+	size_t start = __atomic_fetch_add(&boot_used, need, __ATOMIC_RELAXED);
+	if (size > BOOT_ARENA_SIZE || start + need > BOOT_ARENA_SIZE) {
+		return NULL;
+	}
+	*(size_t *)(boot_arena + start) = size;
+	return boot_arena + start + BOOT_HSIZE;
+}
+
+static size_t boot_usable_size (void *ptr)
+{
+	return *(size_t *)((char *)ptr - BOOT_HSIZE);
+}
+
+static void camel_init_failed (void)
+{
+	static const char msg[] = "libcamel: mm_init failed\n";
+	write(2, msg, sizeof(msg) - 1);
+	abort();
+}
+
+/*
+ * Makes sure mm_init has been called.
+ * Returns 0 if it's being called right now on this thread, in which case
+ * the caller should use the arena.
+ */
+static int camel_ready (void)
+{
+	int state = __atomic_load_n(&camel_state, __ATOMIC_ACQUIRE);
+	if (__builtin_expect(state == CAMEL_READY, 1)) {
+		return 1;
+	}
+	if (state == CAMEL_UNINITIALIZED &&
+	    __atomic_compare_exchange_n(&camel_state, &state, CAMEL_INITIALIZING, 0,
+	                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		camel_init_thread = pthread_self();
+		if (mm_init() < 0) {
+			camel_init_failed();
+		}
+		__atomic_store_n(&camel_state, CAMEL_READY, __ATOMIC_RELEASE);
+		// this may allocate, which is fine now
+		pthread_atfork(mm_atfork_prepare, mm_atfork_parent, mm_atfork_child);
+		return 1;
+	}
+	if (pthread_equal(camel_init_thread, pthread_self())) {
+		return 0;
+	}
+	while (__atomic_load_n(&camel_state, __ATOMIC_ACQUIRE) != CAMEL_READY) {
+		sched_yield();
+	}
+	return 1;
+}
+
+// whether ptr is in the data segment, and so came from mm_malloc
+static int from_camel (void *ptr)
+{
+	return (char *)ptr >= dseg_lo && (char *)ptr <= dseg_hi;
+}
+
+EXPORT void *malloc (size_t size)
+{
+	if (!camel_ready()) {
+		return boot_malloc(size);
+	}
+	// malloc(0) has to give back something that can be freed
+	void *ret = mm_malloc(size > 0 ? size : 1);
+	if (ret == NULL) {
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+EXPORT void free (void *ptr)
+{
+	if (ptr == NULL || from_boot_arena(ptr) || !from_camel(ptr)) {
+		return;
+	}
+	mm_free(ptr);
+}
+
+EXPORT void *calloc (size_t nmemb, size_t size)
+{
+	if (!camel_ready()) {
+		// the arena is static, so it's still all zeros
+		if (size != 0 && nmemb > (size_t)-1 / size) {
+			return NULL;
+		}
+		return boot_malloc(nmemb * size);
+	}
+	if (nmemb == 0 || size == 0) {
+		return malloc(1);
+	}
+	void *ret = mm_calloc(nmemb, size);
+	if (ret == NULL) {
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+EXPORT void *realloc (void *ptr, size_t size)
+{
+	if (ptr != NULL && (from_boot_arena(ptr) || !from_camel(ptr))) {
+		// only ours has a size we know, anything else we can't move
+		if (!from_boot_arena(ptr)) {
+			return NULL;
+		}
+		void *ret = malloc(size);
+		if (ret != NULL) {
+			size_t old_size = boot_usable_size(ptr);
+			memcpy(ret, ptr, old_size < size ? old_size : size);
+		}
+		return ret;
+	}
+	if (!camel_ready()) {
+		return boot_malloc(size);
+	}
+	void *ret = mm_realloc(ptr, size);
+	if (ret == NULL && size > 0) {
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+EXPORT int posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+	if (!camel_ready()) {
+		return ENOMEM;
+	}
+	return mm_posix_memalign(memptr, alignment, size > 0 ? size : 1);
+}
+
+EXPORT void *memalign (size_t alignment, size_t size)
+{
+	if (!camel_ready()) {
+		return NULL;
+	}
+	// like the C library, round odd alignments up to a power of two,
+	// refusing any too big to round without overflowing
+	if (alignment > (SIZE_MAX >> 1) + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t align = 8;
+	while (align < alignment) {
+		align *= 2;
+	}
+	void *ret = mm_memalign(align, size > 0 ? size : 1);
+	if (ret == NULL) {
+		errno = ENOMEM;
+	}
+	return ret;
+}
+
+EXPORT void *aligned_alloc (size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+EXPORT void *valloc (size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+EXPORT void *pvalloc (size_t size)
+{
+	size_t page = getpagesize();
+	return memalign(page, (size + page - 1) / page * page);
+}
+
+EXPORT size_t malloc_usable_size (void *ptr)
+{
+	if (ptr != NULL && from_boot_arena(ptr)) {
+		return boot_usable_size(ptr);
+	}
+	if (ptr == NULL || !from_camel(ptr)) {
+		return 0;
+	}
+	return mm_usable_size(ptr);
+}
@@ -0,0 +1,186 @@
+/**
+ * @file prodcons.c
+ *
+ * prodcons measures the producer/consumer pattern, where every object
+ * is allocated by one thread and freed by another.  A fixed number of
+ * producers allocate objects and hand them to consumers through single
+ * producer, single consumer ring buffers, and the consumers free them.
+ * The run is repeated with 1 up to the given number of consumers, so
+ * the throughput shows how cross-thread frees scale.
+ * With sized set, consumers free with mm_free_sized, passing the size
+ * instead of having the allocator look it up.
+ *
+ * Try the following:
+ *
+ *  prodcons 1 4 1000000 64
+ *  prodcons 2 8 1000000 256
+ *  prodcons 1 4 1000000 64 1
+*/
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "memlib.h"
+#include "malloc.h"
+
+int nproducers = 1;	// Default number of producers.
+int maxconsumers = 4;	// Default largest number of consumers.
+int nobjects = 1000000;	// Default number of objects per producer.
+int size = 64;		// Default object size.
+int sized = 0;		// Default is plain mm_free.
+
+// must be a power of two
+#define RING_SIZE 1024
+
+// one ring per producer and consumer pair, so each has a single writer and reader
+struct ring_t {
+  void *slots[RING_SIZE];
+  volatile unsigned int head __attribute__((aligned(64)));	// next slot to write
+  volatile unsigned int tail __attribute__((aligned(64)));	// next slot to read
+};
+typedef struct ring_t ring;
+
+ring *rings;
+int nconsumers;
+
+ring *get_ring (int producer, int consumer)
+{
+  return &rings[producer * maxconsumers + consumer];
+}
+
+void ring_put (ring *r, void *ptr)
+{
+  while (r->head - r->tail == RING_SIZE) {
+    sched_yield();
+  }
+  r->slots[r->head % RING_SIZE] = ptr;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// returns 0 if the ring is empty
+int ring_get (ring *r, void **ptr)
+{
+  if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) {
+    return 0;
+  }
+  *ptr = r->slots[r->tail % RING_SIZE];
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+
+void * producer (void *arg)
+{
+  int id = (int)(long)arg;
+  int i;
+  for (i = 0; i < nobjects; i++) {
+    char *obj = (char *)mm_malloc(size);
+    obj[0] = (char)i;
+    ring_put(get_ring(id, i % nconsumers), obj);
+  }
+  // tell every consumer this producer is done
+  for (i = 0; i < nconsumers; i++) {
+    ring_put(get_ring(id, i), NULL);
+  }
+  return NULL;
+}
+
+void * consumer (void *arg)
+{
+  int id = (int)(long)arg;
+  int running = nproducers;
+  while (running > 0) {
+    int p;
+    int idle = 1;
+    for (p = 0; p < nproducers; p++) {
+      void *obj;
+      while (ring_get(get_ring(p, id), &obj)) {
+	idle = 0;
+	if (obj == NULL) {
+	  running--;
+	  break;
+	}
+	if (sized) {
+	  mm_free_sized(obj, size);
+	} else {
+	  mm_free(obj);
+	}
+      }
+    }
+    if (idle) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+  if (argc >= 2) {
+    nproducers = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    maxconsumers = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    nobjects = atoi(argv[3]);
+  }
+
+  if (argc >= 5) {
+    size = atoi(argv[4]);
+  }
+
+  if (argc >= 6) {
+    sized = atoi(argv[5]);
+  }
+
+  if (nproducers < 1 || maxconsumers < 1 || nobjects < 1 || size < 1) {
+    fprintf (stderr, "Usage: %s nproducers maxconsumers nobjects size [sized]\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Running prodcons for %d producers, up to %d consumers, %d objects of size %d per producer%s...\n",
+	  nproducers, maxconsumers, nobjects, size, sized ? ", sized frees" : "");
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+
+  rings = (ring *)calloc(nproducers * maxconsumers, sizeof(ring));
+  pthread_t *threads = (pthread_t *)malloc((nproducers + maxconsumers) * sizeof(pthread_t));
+
+  printf ("%10s %12s %16s\n", "consumers", "seconds", "objects/second");
+  for (nconsumers = 1; nconsumers <= maxconsumers; nconsumers++) {
+    int i;
+    for (i = 0; i < nproducers * maxconsumers; i++) {
+      rings[i].head = rings[i].tail = 0;
+    }
+
+    timer_start();
+
+    for (i = 0; i < nconsumers; i++) {
+      pthread_create(&threads[i], NULL, consumer, (void *)(long)i);
+    }
+    for (i = 0; i < nproducers; i++) {
+      pthread_create(&threads[nconsumers + i], NULL, producer, (void *)(long)i);
+    }
+    for (i = 0; i < nconsumers + nproducers; i++) {
+      pthread_join(threads[i], NULL);
+    }
+
+    double t = timer_stop();
+    printf ("%10d %12f %16.0f\n", nconsumers, t, (double)nproducers * nobjects / t);
+  }
+
+  printf ("Memory used = %ld bytes\n", mem_usage());
+  return 0;
+}
@@ -0,0 +1,185 @@
+/**
+ * @file rsstest.c
+ *
+ * rsstest tracks resident memory over time for a load that peaks and
+ * then goes idle, the way larson's rounds do.  Each thread keeps a pool
+ * of live objects and, like larson, keeps freeing a random one and
+ * replacing it with a new object of random size.  The pool size changes
+ * every phase, alternating between the peak and the idle size, so
+ * whatever the allocator does with the memory freed at the end of a peak
+ * shows up in the samples of the idle phase after it.
+ *
+ * Every sample prints the time, the phase, the resident set size from
+ * /proc/self/statm, and the bytes handed out by mem_sbrk, all in KB.
+ *
+ * Try the following:
+ *
+ *  rsstest 2 50000 1000 3000 4
+ *  CAMEL_RELEASE_DELAY_MS=0 CAMEL_DIRTY_HIGH_KB=0 rsstest 2 50000 1000 3000 4
+*/
+
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "mm_thread.h"
+#include "memlib.h"
+#include "malloc.h"
+
+int nthreads = 2;	// Default number of threads.
+int peak_objects = 50000;	// Default objects per thread at the peak.
+int idle_objects = 1000;	// Default objects per thread while idle.
+int phase_ms = 3000;	// Default length of a phase.
+int nphases = 4;	// Default number of phases.
+int minsize = 10;	// Default smallest object size.
+int maxsize = 500;	// Default biggest object size.
+
+#define SAMPLE_MS 100
+
+volatile int target;	// How many objects each thread should have live.
+volatile int done;
+
+
+long now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// resident set size of this process in KB
+long rss_kb (void)
+{
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+    resident = -1;
+  }
+  fclose(f);
+  return resident * (getpagesize() / 1024);
+}
+
+
+void * worker (void *arg)
+{
+  unsigned int seed = (unsigned int)(long)arg + 1;
+  char **objs = (char **)malloc(peak_objects * sizeof(char *));
+  int live = 0;
+  int i;
+
+  while (!done) {
+    int want = target;
+    while (live > want) {
+      mm_free(objs[--live]);
+    }
+    while (live < want) {
+      int size = minsize + rand_r(&seed) % (maxsize - minsize + 1);
+      objs[live] = (char *)mm_malloc(size);
+      objs[live][0] = 1;
+      live++;
+    }
+    // churn the pool like larson does
+    for (i = 0; i < 1000 && live > 0; i++) {
+      int victim = rand_r(&seed) % live;
+      int size = minsize + rand_r(&seed) % (maxsize - minsize + 1);
+      mm_free(objs[victim]);
+      objs[victim] = (char *)mm_malloc(size);
+      objs[victim][0] = 1;
+    }
+  }
+
+  for (i = 0; i < live; i++) {
+    mm_free(objs[i]);
+  }
+  free(objs);
+  return NULL;
+}
+
+
+int main (int argc, char * argv[])
+{
+  pthread_t *threads;
+  int i;
+
+  if (argc >= 2) {
+    nthreads = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    peak_objects = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    idle_objects = atoi(argv[3]);
+  }
+
+  if (argc >= 5) {
+    phase_ms = atoi(argv[4]);
+  }
+
+  if (argc >= 6) {
+    nphases = atoi(argv[5]);
+  }
+
+  if (argc >= 7) {
+    minsize = atoi(argv[6]);
+  }
+
+  if (argc >= 8) {
+    maxsize = atoi(argv[7]);
+  }
+
+  if (nthreads < 1 || peak_objects < idle_objects || idle_objects < 1 ||
+      minsize < 1 || maxsize < minsize) {
+    fprintf (stderr, "Usage: %s nthreads peak_objects idle_objects phase_ms nphases [minsize maxsize]\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Running rsstest for %d threads, %d objects at the peak, %d idle, %d phases of %d ms...\n",
+	  nthreads, peak_objects, idle_objects, nphases, phase_ms);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+
+  threads = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+  target = peak_objects;
+  done = 0;
+  for (i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+  }
+
+  printf ("%8s %6s %8s %10s %10s\n", "ms", "phase", "objects", "rss KB", "used KB");
+  long start = now_ms();
+  long peak_rss = 0;
+  long last_rss = 0;
+  int phase;
+  for (phase = 0; phase < nphases; phase++) {
+    target = (phase % 2 == 0) ? peak_objects : idle_objects;
+    long phase_end = start + (phase + 1) * (long)phase_ms;
+    long t;
+    while ((t = now_ms()) < phase_end) {
+      last_rss = rss_kb();
+      if (last_rss > peak_rss) {
+	peak_rss = last_rss;
+      }
+      printf ("%8ld %6d %8d %10ld %10ld\n", t - start, phase, target, last_rss, mem_usage() / 1024);
+      usleep(SAMPLE_MS * 1000);
+    }
+  }
+
+  done = 1;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  printf ("Peak RSS = %ld KB, RSS at the end of the last phase = %ld KB\n", peak_rss, last_rss);
+  return 0;
+}
@@ -24,6 +24,9 @@
  * This program does nothing but generate a number of kernel threads
  * that allocate and free memory, with a variable
  * amount of "work" (i.e. cycle wasting) in between.
+ *
+ * With a batch size as the last argument, the objects are allocated and
+ * freed that many at a time with mm_malloc_batch and mm_free_batch.
 */
 
 #ifndef _REENTRANT
@@ -38,12 +41,14 @@
 #include "mm_thread.h"
 #include "timer.h"
 #include "malloc.h"
+#include "memlib.h"
 
 int niterations = 50;	// Default number of iterations.
 int nobjects = 30000;   // Default number of objects.
 int nthreads = 1;	// Default number of threads.
 int work = 0;		// Default number of loop iterations.
 int size = 1;
+int batch = 0;		// Default is one object at a time.
 
 struct Foo {
   int x;
@@ -62,6 +67,24 @@ extern void * worker (void *arg)
 
   a = (struct Foo **)mm_malloc( (nobjects / nthreads) * sizeof(struct Foo *));
 
+  if (batch > 0) {
+    for (j = 0; j < niterations; j++) {
+      for (i = 0; i < (nobjects / nthreads); i += batch) {
+	int n = (nobjects / nthreads) - i < batch ? (nobjects / nthreads) - i : batch;
+	if (mm_malloc_batch(size*sizeof(struct Foo), n, (void **)&a[i]) != n) {
+	  fprintf (stderr, "mm_malloc_batch ran out of memory\n");
+	  exit (1);
+	}
+      }
+      for (i = 0; i < (nobjects / nthreads); i += batch) {
+	int n = (nobjects / nthreads) - i < batch ? (nobjects / nthreads) - i : batch;
+	mm_free_batch((void **)&a[i], n);
+      }
+    }
+    mm_free(a);
+    return NULL;
+  }
+
   for (j = 0; j < niterations; j++) {
 
     // printf ("%d\n", j);
@@ -118,7 +141,14 @@ int main (int argc, char * argv[])
     size = atoi(argv[5]);
   }
 
+  if (argc >= 7) {
+    batch = atoi(argv[6]);
+  }
+
   printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work and %d size...\n", nthreads, niterations, nobjects, work, size);
+  if (batch > 0) {
+    printf ("Allocating and freeing in batches of %d\n", batch);
+  }
 
   /* Call allocator-specific initialization function */
   mm_init();
@@ -142,10 +172,10 @@ int main (int argc, char * argv[])
     pthread_join(threads[i], NULL);
   }
 
-  double t = timer_stop();
+  u_int64_t ns = timer_stop_ns();
 
-  printf ("Time elapsed = %f seconds\n", t);
-  printf ("Memory used = %d bytes\n",mem_usage());
+  printf ("Time elapsed = %f seconds (%llu ns)\n", ns / 1e9, (unsigned long long)ns);
+  printf ("Memory used = %ld bytes\n",mem_usage());
 
   mm_free(threads);
 
@@ -1,62 +1,24 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-#include <stdio.h>
-#include <limits.h>
-#include <time.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <string.h>
 #include "tsc.h"
 
-
-static double getFrequency (void) {
-	static double freq = 0.0;
-	unsigned long LTime0, LTime1, HTime0, HTime1;
-	ssize_t bytes_read;
-
-	if (freq == 0.0) {
-
-		// Parse out the CPU frequency from the /proc/cpuinfo file.
-
-		enum { MAX_PROCFILE_SIZE = 32768 };
-		const char searchStr[] = "cpu MHz		: ";
-		char line[MAX_PROCFILE_SIZE];
-		int fd = open ("/proc/cpuinfo", O_RDONLY);
-		if ((bytes_read = read(fd, line, MAX_PROCFILE_SIZE)) == -1) {
-			perror("getFrequency: Error reading from /proc/cpuinfo");
-			return freq;
-		}
-		char * pos = strstr (line, searchStr);
-		if (pos == NULL) {
-			
-			// Compute MHz directly.
-			// Wait for approximately one second.
-			
-			start_counter();
-			sleep (1);
-			freq = get_counter();
-			
-		} else {
-			// Move the pointer over to the MHz number itself.
-			pos += strlen(searchStr);
-			float f;
-			sscanf (pos, "%f", &f);
-			freq = (double) f * 1000000.0;
-		}
-		
-	}
-	return freq;
-}
+/* Time an interval in the calling thread; other threads can time their
+ * own at the same time. The counter is calibrated against
+ * CLOCK_MONOTONIC_RAW the first time, see tsc.c */
 
 void timer_start (void) {
 	start_counter();
 }
 
+/* nanoseconds since timer_start */
+u_int64_t timer_stop_ns (void) {
+	return counter_ns(get_counter());
+}
+
+/* seconds since timer_start */
 double timer_stop (void) {
-	u_int64_t elapsed = get_counter();
-	double freq = getFrequency ();
-	return elapsed / freq;
+	return timer_stop_ns() / 1e9;
 }
 
 #endif /* _TIMER_H */
@@ -0,0 +1,137 @@
+/**
+ * @file tlbtest.c
+ *
+ * tlbtest measures how long it takes to reach objects scattered across
+ * the heap, which is mostly the cost of TLB misses once the working set
+ * spans more pages than the TLB can map.  Like larson, it fills a pool
+ * with objects of random size and churns it by freeing random objects
+ * and replacing them, so neighbours in memory are unrelated.  Then it
+ * links every object into one cycle in random order and chases the
+ * pointers around it, so every step is a dependent load from a random
+ * page.
+ *
+ * It prints the nanoseconds per step, along with the resident set size
+ * and the bytes handed out by mem_sbrk, in KB.
+ *
+ * Try the following, to compare 4KB pages with huge pages:
+ *
+ *  tlbtest 400000 10 500 4
+ *  CAMEL_HUGEPAGES=1 tlbtest 400000 10 500 4
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "malloc.h"
+
+int nobjects = 400000;	// Default number of live objects.
+int minsize = 10;	// Default smallest object size.
+int maxsize = 500;	// Default biggest object size.
+int nrounds = 4;	// Default number of times around the cycle.
+
+
+long now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// resident set size of this process in KB
+long rss_kb (void)
+{
+  long size, resident;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2) {
+    resident = -1;
+  }
+  fclose(f);
+  return resident * (getpagesize() / 1024);
+}
+
+
+int main (int argc, char * argv[])
+{
+  unsigned int seed = 1;
+  void ***objs;
+  int i;
+
+  if (argc >= 2) {
+    nobjects = atoi(argv[1]);
+  }
+
+  if (argc >= 3) {
+    minsize = atoi(argv[2]);
+  }
+
+  if (argc >= 4) {
+    maxsize = atoi(argv[3]);
+  }
+
+  if (argc >= 5) {
+    nrounds = atoi(argv[4]);
+  }
+
+  // every object holds the pointer to the next one
+  if (nobjects < 2 || minsize < (int)sizeof(void *) || maxsize < minsize || nrounds < 1) {
+    fprintf (stderr, "Usage: %s nobjects [minsize maxsize nrounds]\n", argv[0]);
+    return 1;
+  }
+
+  printf ("Running tlbtest for %d objects of %d to %d bytes, %d rounds...\n",
+	  nobjects, minsize, maxsize, nrounds);
+
+  /* Call allocator-specific initialization function */
+  mm_init();
+
+  objs = (void ***)malloc(nobjects * sizeof(void **));
+  for (i = 0; i < nobjects; i++) {
+    objs[i] = (void **)mm_malloc(minsize + rand_r(&seed) % (maxsize - minsize + 1));
+  }
+  // churn the pool like larson does
+  for (i = 0; i < nobjects; i++) {
+    int victim = rand_r(&seed) % nobjects;
+    mm_free(objs[victim]);
+    objs[victim] = (void **)mm_malloc(minsize + rand_r(&seed) % (maxsize - minsize + 1));
+  }
+
+  // shuffle, then link the objects into a cycle in that order
+  for (i = nobjects - 1; i > 0; i--) {
+    int j = rand_r(&seed) % (i + 1);
+    void **tmp = objs[i];
+    objs[i] = objs[j];
+    objs[j] = tmp;
+  }
+  for (i = 0; i < nobjects; i++) {
+    *objs[i] = objs[(i + 1) % nobjects];
+  }
+
+  // once around to warm up, then time the rest
+  void **p = objs[0];
+  for (i = 0; i < nobjects; i++) {
+    p = (void **)*p;
+  }
+  long steps = (long)nobjects * nrounds;
+  long start = now_ns();
+  long s;
+  for (s = 0; s < steps; s++) {
+    p = (void **)*p;
+  }
+  long elapsed = now_ns() - start;
+
+  printf ("%.2f ns per step, rss = %ld KB, used = %ld KB%s\n",
+	  (double)elapsed / steps, rss_kb(), mem_usage() / 1024,
+	  p == NULL ? " (lost)" : "");
+
+  for (i = 0; i < nobjects; i++) {
+    mm_free(objs[i]);
+  }
+  free(objs);
+  return 0;
+}
@@ -1,35 +1,179 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "tsc.h"
+
+/* where start_counter was last called, by each thread on its own */
+static __thread u_int64_t start = 0;
+
+/* what the counter is, worked out once by calibrate: the time stamp
+ * counter where it ticks at the same rate whatever the clock speed and
+ * sleep state (an invariant TSC), or else CLOCK_MONOTONIC_RAW in ns */
+static pthread_once_t calibrated = PTHREAD_ONCE_INIT;
+static int use_tsc = 0;
+static int have_rdtscp = 0;
+static double counts_per_sec = 1e9;
+
+/* how long calibrate compares the TSC against the clock for */
+#define CALIBRATE_NS 20000000L
 
-/* initialize the cycle counter */
-u_int64_t start = 0;
 
+static u_int64_t raw_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Read the time stamp counter at the start of an interval: lfence keeps
+ * it from being read before the instructions ahead of it are done.
+ */
+static inline u_int64_t tsc_begin(void)
+{
+  unsigned hi, lo;
+  asm volatile("lfence; rdtsc" : "=d" (hi), "=a" (lo) : : "memory");
+  return ((u_int64_t)hi << 32) | lo;
+}
+
+/* Read it at the end of one: rdtscp waits for everything before it, and
+ * the lfence after keeps what follows from starting early. Without
+ * rdtscp, lfence on both sides does the same.
+ */
+static inline u_int64_t tsc_end(void)
+{
+  unsigned hi, lo, aux;
+  if (have_rdtscp) {
+    asm volatile("rdtscp; lfence" : "=d" (hi), "=a" (lo), "=c" (aux) : : "memory");
+  } else {
+    asm volatile("lfence; rdtsc; lfence" : "=d" (hi), "=a" (lo) : : "memory");
+  }
+  return ((u_int64_t)hi << 32) | lo;
+}
 
-/* Set *hi and *lo to the high and low order bits of the cycle counter.
- * Implementation requires assembly code to use the rdtsc instruction.
+/* The clock and the TSC at as close to the same moment as we can get:
+ * the TSC read in between the two clock reads that are closest together
+ * out of a few tries.
  */
-inline void access_counter(unsigned *hi, unsigned *lo)
+static void sample(u_int64_t *ns, u_int64_t *tsc)
 {
-  asm volatile("rdtsc; movl %%edx, %0; movl %%eax, %1" /* Read cycle counter */
-      : "=r" (*hi), "=r" (*lo)                /* and move results to */
-      : /* No input */                        /* the two outputs */
-      : "%edx", "%eax");
+  u_int64_t best = ~0ULL;
+  int i;
+  *ns = *tsc = 0;
+  for (i = 0; i < 5; i++) {
+    u_int64_t before = raw_ns();
+    u_int64_t t = tsc_end();
+    u_int64_t after = raw_ns();
+    if (after - before < best) {
+      best = after - before;
+      *ns = before + (after - before) / 2;
+      *tsc = t;
+    }
+  }
 }
+#endif
 
+static void calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+    have_rdtscp = (edx >> 27) & 1;
+  }
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !((edx >> 8) & 1)) {
+    return;
+  }
+  u_int64_t ns0, tsc0, ns1, tsc1;
+  struct timespec wait = { 0, CALIBRATE_NS };
+  sample(&ns0, &tsc0);
+  nanosleep(&wait, NULL);
+  sample(&ns1, &tsc1);
+  if (ns1 > ns0 && tsc1 > tsc0) {
+    counts_per_sec = (double)(tsc1 - tsc0) * 1e9 / (ns1 - ns0);
+    use_tsc = 1;
+  }
+#endif
+}
+
+/* read the counter at the start of an interval, or at the end of one */
+static inline u_int64_t counter_begin(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_tsc)
+    return tsc_begin();
+#endif
+  return raw_ns();
+}
+
+static inline u_int64_t counter_end(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_tsc)
+    return tsc_end();
+#endif
+  return raw_ns();
+}
+
+
+/* Start timing an interval in this thread, calibrating the counter the
+ * first time anyone does.
+ */
 void start_counter()
 {
-  unsigned hi, lo;
-  access_counter(&hi, &lo);
-  start = ((u_int64_t)hi << 32) | lo;
+  pthread_once(&calibrated, calibrate);
+  start = counter_begin();
 }
 
+/* Counts since this thread last called start_counter */
 u_int64_t get_counter()
 {
-  unsigned ncyc_hi, ncyc_lo;
+  return counter_end() - start;
+}
 
-  /* Get the cycle counter */
-  access_counter(&ncyc_hi, &ncyc_lo);
+/* How many counts a second has */
+double counter_frequency()
+{
+  pthread_once(&calibrated, calibrate);
+  return counts_per_sec;
+}
 
-  return (((u_int64_t)ncyc_hi << 32) | ncyc_lo) - start;
+/* Counts as nanoseconds */
+u_int64_t counter_ns(u_int64_t counts)
+{
+  return (u_int64_t)(counts * (1e9 / counter_frequency()));
+}
 
+/* Return the cycle counter itself, for timing intervals independently
+ * of start_counter. This is always the TSC where there is one, as
+ * cycles, whether or not the timing above uses it, and it isn't
+ * serialized, so it stays cheap enough for the lock profile.
+ */
+u_int64_t read_counter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned hi, lo;
+  asm volatile("rdtsc" : "=d" (hi), "=a" (lo));
+  return ((u_int64_t)hi << 32) | lo;
+#else
+  return raw_ns();
+#endif
 }
 
+/* How many counts of read_counter a second has: the TSC's rate where
+ * it's invariant, or 0 where its rate can't be known.
+ */
+double read_counter_frequency()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  pthread_once(&calibrated, calibrate);
+  return use_tsc ? counts_per_sec : 0;
+#else
+  return 1e9;
+#endif
+}
@@ -1,5 +1,10 @@
 #ifndef TSC_H
 #define TSC_H
+#include <sys/types.h>
 extern void start_counter();
 extern u_int64_t get_counter();
+extern double counter_frequency();
+extern u_int64_t counter_ns(u_int64_t counts);
+extern u_int64_t read_counter();
+extern double read_counter_frequency();
 #endif